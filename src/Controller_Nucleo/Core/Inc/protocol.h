@@ -8,10 +8,68 @@
 #ifndef INC_PROTOCOL_H_
 #define INC_PROTOCOL_H_
 
+#include <stddef.h>
+
 #include "stm32l1xx_hal.h"
 
 #define TIMEOUT_TX 500
-#define MAX_BUFFER_SIZE 528
+
+/// Marks the variables holding the state of a board. Empty on the boards,
+/// the host simulation uses it to keep one copy of the state per board.
+#ifndef BOARD_STATE
+#define BOARD_STATE
+#endif
+
+/// Size in bytes of the packets on the wire
+#define HEADER_SIZE 25
+#define BODY_SIZE 534
+#define MAX_BUFFER_SIZE BODY_SIZE
+
+/// Every frame starts with this preamble, sent as 0xA5 0x5A, followed by
+/// the size of the frame and its type. A receiver that lost track of the
+/// frames looks for the next place where the three agree.
+#define FRAME_SYNC 0x5AA5
+#define FRAME_PREFIX_SIZE 5
+
+/// Bytes received in each direction that the main loop can fall behind by,
+/// the frame being handled included. Must be a power of two.
+#define RX_RING_SIZE 2048
+
+/// Frames passed along the chain are sent on in chunks of this many bytes
+/// as they arrive, instead of once they are complete
+#define FORWARD_CHUNK_SIZE 16
+
+/// CRC-16/MODBUS, reflected polynomial 0xA001
+#define CRC_INIT 0xFFFF
+
+/// Set in the argument of a BAUD header to switch to the rate it carries.
+/// Without it the header only asks the boards if they support the rate.
+#define BAUD_COMMIT 0x80000000
+
+/// Argument of a RANGE_READ or DIGEST header, with the first block and the
+/// number of blocks
+#define RANGE_OFFSET(arg) ((uint16_t)((arg) & 0xFFFF))
+#define RANGE_NUM_BLOCKS(arg) ((uint16_t)((arg) >> 16))
+
+/// Blocks of 512 bytes in the SRAM of the STM32L152RE, ranges and blocks
+/// past the last one are refused
+#define SRAM_NUM_BLOCKS 160
+
+/// Argument of a COLLECT header, with the block to read and the number of
+/// boards in the chain
+#define COLLECT_OFFSET(arg) ((uint16_t)((arg) & 0xFFFF))
+#define COLLECT_NUM_BOARDS(arg) ((uint16_t)((arg) >> 16))
+
+/// FNV-1a, 32 bits, used for the digest of a region of SRAM
+#define DIGEST_INIT 0x811C9DC5
+#define DIGEST_PRIME 0x01000193
+
+/// Slowest baud rate accepted when negotiating
+#define BAUD_MIN 9600
+
+/// Time a board waits for a header at the new baud rate before going back
+/// to the previous one
+#define BAUD_CONFIRM_MS 1000
 
 typedef enum {
 	Idle_State,
@@ -28,6 +86,12 @@ typedef enum {
 	  READ = 3,
 	  WRITE = 4,
 	  EXEC = 5,
+	  BAUD = 9,
+	  RANGE_READ = 10,
+	  RANGE_END = 11,
+	  DIGEST = 12,
+	  COLLECT = 13,
+	  NACK = 14,
 } HeaderType;
 
 typedef enum {
@@ -37,18 +101,31 @@ typedef enum {
 } BodyType;
 
 typedef struct header_t {
+        uint16_t sync;
+        uint16_t length;
+
         uint8_t type;
         uint8_t ttl;
-        uint8_t crc;
+
+        // Chosen by the station and copied into every frame sent in answer,
+        // so that several requests can be in flight on a chain
+        uint8_t seq;
+        uint16_t crc;
 
         uint32_t bid_high;
         uint32_t bid_medium;
         uint32_t bid_low;
+
+        uint32_t arg;
 } __attribute__((packed)) header_t;
 
 typedef struct body_t {
+		uint16_t sync;
+		uint16_t length;
+
 		uint8_t type;
-		uint8_t crc;
+		uint8_t seq;
+		uint16_t crc;
 
 		uint32_t bid_high;
 		uint32_t bid_medium;
@@ -56,15 +133,67 @@ typedef struct body_t {
 
 		uint16_t mem_address;
 		uint8_t data[512];
-} body_t;
+} __attribute__((packed)) body_t;
+
+_Static_assert(sizeof(header_t) == HEADER_SIZE, "header_t must match the station");
+_Static_assert(sizeof(body_t) == BODY_SIZE, "body_t must match the station");
+_Static_assert(offsetof(header_t, type) + 1 == FRAME_PREFIX_SIZE
+		&& offsetof(body_t, type) + 1 == FRAME_PREFIX_SIZE,
+		"frames must start with the preamble, the size and the type");
+_Static_assert((RX_RING_SIZE & (RX_RING_SIZE - 1)) == 0, "RX_RING_SIZE must be a power of two");
+
+/// Bytes received through a USART and the frame being assembled from them
+///
+/// The interrupt of the USART only writes head, the main loop only writes
+/// tail, so neither needs to disable interrupts. The bytes of a frame stay
+/// in the ring until the frame has been handled, so that the search for
+/// the next frame can start over from them if the frame is corrupted.
+typedef struct rx_stream_t {
+	uint8_t ring[RX_RING_SIZE];
+	volatile uint16_t head;
+	volatile uint16_t tail;
+
+	/// Next byte to move into the frame
+	uint16_t next;
+
+	/// Bytes dropped because the ring was full
+	uint16_t dropped;
+
+	/// Frame being assembled. Its size is known from its prefix, 0 until
+	/// the prefix has arrived.
+	uint8_t frame[MAX_BUFFER_SIZE];
+	uint16_t num_bytes;
+	uint16_t expected;
+
+	/// Bytes of the frame already sent on along the chain
+	uint16_t forwarded;
+} rx_stream_t;
 
 
 void init_configuration(void);
 
+uint16_t crc16_update(uint16_t crc, const uint8_t *buf, uint32_t len);
+uint16_t header_crc(header_t *header);
+uint16_t body_crc(body_t *body);
+uint32_t digest_update(uint32_t digest, const uint8_t *buf, uint32_t len);
+
+uint16_t frame_size(uint8_t type);
+void rx_push(rx_stream_t *rx, uint8_t byte);
+uint8_t rx_parse(rx_stream_t *rx);
+void rx_release(rx_stream_t *rx);
+void rx_reject(rx_stream_t *rx);
+void rx_flush(rx_stream_t *rx);
+void receive_byte(UART_HandleTypeDef *huart, uint8_t byte);
+
 uint8_t parse_body(uint8_t *buffer, body_t *body);
 uint8_t parse_header(uint8_t *usart_buffer, header_t *header);
 void write_mem_values(body_t *body);
 
+uint32_t get_bid_high(void);
+uint32_t get_bid_medium(void);
+uint32_t get_bid_low(void);
+
+void transmit_frame(UART_HandleTypeDef *huart, uint8_t *frame, uint16_t num_bytes);
 void transmit_header(UART_HandleTypeDef *huart, header_t *header);
 void transmit_body(UART_HandleTypeDef *huart, body_t *body);
 void transmit_ACK(header_t *header);
@@ -72,6 +201,9 @@ void transmit_buffer(uint8_t *buffer, uint16_t num_bytes);
 
 SystemState header_handler(header_t *header);
 SystemState body_handler(body_t *body);
+SystemState crc_error_handler(void);
+
+void protocol_poll(void);
 
 
 
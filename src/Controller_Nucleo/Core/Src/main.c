@@ -42,19 +42,17 @@
 /* Private variables ---------------------------------------------------------*/
 UART_HandleTypeDef huart1;
 UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_usart1_tx;
+DMA_HandleTypeDef hdma_usart3_tx;
 
 /* USER CODE BEGIN PV */
-SystemState curr_state = Idle_State, next_state;
-extern uint8_t up_buffer[];
-extern uint8_t down_buffer[];
-extern uint16_t num_bytes_up;
-extern uint16_t num_bytes_down;
-extern uint16_t waiting_read_down;
+
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_USART1_UART_Init(void);
 static void MX_USART3_UART_Init(void);
 /* USER CODE BEGIN PFP */
@@ -94,16 +92,13 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_USART1_UART_Init();
   MX_USART3_UART_Init();
   /* USER CODE BEGIN 2 */
 
   init_configuration();
 
-  header_t header;
-  body_t body;
-  uint8_t err = 0;
-
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -113,63 +108,7 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
-	  switch (curr_state) {
-	  case Idle_State:
-		  break;
-
-	  case Read_Header_State:
-		  err = parse_header((uint8_t *)&up_buffer, &header);
-		  next_state = header_handler(&header);
-		  break;
-
-	  case Read_Region_State:
-	  case Read_Sensors_State:
-		  err = parse_body((uint8_t *)&up_buffer, &body);
-		  next_state = body_handler(&body);
-		  break;
-
-	  case Transport_State:
-		  transmit_buffer((uint8_t *)&down_buffer, num_bytes_down);
-
-		  // ACK received. Prepare to receive body from down
-		  if (num_bytes_down == 15 && waiting_read_down == 1) {
-			  num_bytes_down = 0;
-			  HAL_UART_Receive_IT(&huart3, (uint8_t *)&down_buffer, MAX_BUFFER_SIZE);
-		  } else {
-			  // Prepare to received a header
-			  num_bytes_down = 0;
-			  HAL_UART_Receive_IT(&huart3, (uint8_t *)&down_buffer, 15);
-		  }
-
-		  next_state = Idle_State;
-		  break;
-
-	  case Execute_Code_State:
-		  break;
-	  default:
-		  break;
-	  }
-
-	  /// Each slave makes use of two USARTs, being those 1 and 3
-	  ///   USART1 will be used to receive data
-	  ///   USART3 will be used to transmit data
-	  ///
-	  /// The package should go up the chain without any type of intervention
-	  if (num_bytes_up == 15) {
-		  	num_bytes_up = 0;
-	  		next_state = Read_Header_State;
-	  } else if (num_bytes_up == MAX_BUFFER_SIZE) {
-		  num_bytes_up = 0;
-		  next_state = Read_Region_State;
-	  } else if(waiting_read_down == 1 && num_bytes_down == MAX_BUFFER_SIZE) {
-		  waiting_read_down = 0;
-		  next_state = Transport_State;
-	  } else if (num_bytes_down == 15) {
-	  		next_state = Transport_State;
-	  }
-	  curr_state = next_state;
-
-//  curr_state = next_state;
+	  protocol_poll();
   } // end while
   /* USER CODE END 3 */
 }
@@ -281,6 +220,25 @@ static void MX_USART3_UART_Init(void)
 
 }
 
+/**
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Channel2_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel2_IRQn);
+  /* DMA1_Channel4_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+
+}
+
 /**
   * @brief GPIO Initialization Function
   * @param None
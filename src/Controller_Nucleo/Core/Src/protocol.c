@@ -6,78 +6,411 @@
  */
 
 
+#include <stddef.h>
+#include <string.h>
+
 #include "protocol.h"
 
 extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart3;
 
-uint8_t up_buffer[MAX_BUFFER_SIZE] = {0};
-uint8_t down_buffer[MAX_BUFFER_SIZE] = {0};
+/// Bytes received from up and down the chain. Frames from down the chain
+/// are always passed up, bodies from up the chain are passed down when they
+/// are for another board.
+BOARD_STATE rx_stream_t rx_up;
+BOARD_STATE rx_stream_t rx_down;
+BOARD_STATE uint8_t forwarding_up = 0;
+
+BOARD_STATE uint32_t adc_values[2];
+BOARD_STATE uint8_t write_mem_en = 0;
+
+/// Frames being sent by DMA, which must not change until the DMA is done
+BOARD_STATE static uint8_t tx_buffer_up[MAX_BUFFER_SIZE] __attribute__((aligned(4)));
+BOARD_STATE static uint8_t tx_buffer_down[MAX_BUFFER_SIZE] __attribute__((aligned(4)));
+
+/// State of the main loop
+BOARD_STATE static SystemState curr_state = Idle_State;
+BOARD_STATE static SystemState next_state = Idle_State;
+BOARD_STATE static header_t header;
+BOARD_STATE static body_t body;
+
+/// Baud rate to go back to if the new one is not confirmed in time, 0 once
+/// it has been confirmed
+BOARD_STATE static uint32_t fallback_baud_rate = 0;
+BOARD_STATE static uint32_t baud_switched_at = 0;
+
+/// Range read being streamed up the chain. The trailer is sent once no
+/// blocks are left.
+BOARD_STATE static uint16_t range_next = 0;
+BOARD_STATE static uint16_t range_left = 0;
+BOARD_STATE static uint16_t range_num_blocks = 0;
+BOARD_STATE static uint8_t range_seq = 0;
+BOARD_STATE static uint8_t range_streaming = 0;
+
+/// COLLECT header to pass down once the block of this board has been sent
+BOARD_STATE static header_t collect_header;
+BOARD_STATE static uint8_t collect_pending = 0;
+
+/// Set while a frame of this board waits for the one being passed up from
+/// down the chain, with the time it started waiting
+BOARD_STATE static uint8_t up_link_waiting = 0;
+BOARD_STATE static uint32_t up_link_waiting_since = 0;
+
+/// Time waited after sending an ACK
+///
+/// The ACK is only sent once the board is ready for the next frame, so
+/// there is no need to wait. Only the host simulation changes it, to
+/// compare with the fixed delay used before.
+uint32_t handshake_delay_ms = 0;
+
+/// Bytes gathered before sending them on, 0 to wait for the whole frame
+///
+/// Only the host simulation changes it, to compare with store-and-forward.
+uint16_t forward_chunk_size = FORWARD_CHUNK_SIZE;
+
+
+/// Lookup table for CRC-16/MODBUS, stored in flash
+static const uint16_t crc_table[256] = {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+};
+
+/// Continue a CRC-16 with more data
+///
+/// Chaining calls allows computing the CRC of data which is not contiguous,
+/// like a body whose data is read straight from SRAM.
+uint16_t crc16_update(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+	while (len--) {
+		crc = (crc >> 8) ^ crc_table[(crc ^ *buf++) & 0xFF];
+	}
+	return crc;
+}
+
+/// CRC of every field of the header except the CRC itself
+uint16_t header_crc(header_t *header)
+{
+	uint8_t *bytes = (uint8_t *)header;
+	uint16_t crc = crc16_update(CRC_INIT, bytes, offsetof(header_t, crc));
+
+	return crc16_update(crc, bytes + offsetof(header_t, bid_high),
+			HEADER_SIZE - offsetof(header_t, bid_high));
+}
+
+/// CRC of every field of the body except the CRC itself
+uint16_t body_crc(body_t *body)
+{
+	uint8_t *bytes = (uint8_t *)body;
+	uint16_t crc = crc16_update(CRC_INIT, bytes, offsetof(body_t, crc));
+
+	return crc16_update(crc, bytes + offsetof(body_t, bid_high),
+			BODY_SIZE - offsetof(body_t, bid_high));
+}
+
+/// Continue an FNV-1a digest with more data
+uint32_t digest_update(uint32_t digest, const uint8_t *buf, uint32_t len)
+{
+	while (len--) {
+		digest = (digest ^ *buf++) * DIGEST_PRIME;
+	}
+	return digest;
+}
+
+/// Size of the frame starting with a type byte
+///
+/// Returns 0 if no frame starts with it.
+uint16_t frame_size(uint8_t type)
+{
+	switch (type) {
+	case ACK:
+	case PING:
+	case READ:
+	case WRITE:
+	case EXEC:
+	case BAUD:
+	case RANGE_READ:
+	case RANGE_END:
+	case DIGEST:
+	case COLLECT:
+	case NACK:
+		return HEADER_SIZE;
+	case MEMORY:
+	case SENSORS:
+	case CODE:
+		return BODY_SIZE;
+	default:
+		return 0;
+	}
+}
+
+/// Store a byte received through a USART, from its interrupt
+///
+/// The byte is dropped if the main loop is a whole ring behind.
+void rx_push(rx_stream_t *rx, uint8_t byte)
+{
+	uint16_t head = rx->head;
+	uint16_t next = (head + 1) & (RX_RING_SIZE - 1);
+
+	if (next == rx->tail) {
+		rx->dropped++;
+		return;
+	}
+
+	rx->ring[head] = byte;
+	rx->head = next;
+}
+
+/// Size of the frame starting at a byte of the ring
+///
+/// Returns 0 if the preamble, the size and the type do not agree.
+static uint16_t frame_start(rx_stream_t *rx, uint16_t at)
+{
+	uint8_t prefix[FRAME_PREFIX_SIZE];
+	uint16_t length;
+
+	for (int i = 0; i < FRAME_PREFIX_SIZE; i++) {
+		prefix[i] = rx->ring[(at + i) & (RX_RING_SIZE - 1)];
+	}
+
+	length = prefix[2] | (prefix[3] << 8);
+	if (prefix[0] != (FRAME_SYNC & 0xFF) || prefix[1] != (FRAME_SYNC >> 8)
+			|| length != frame_size(prefix[4])) {
+		return 0;
+	}
+	return length;
+}
+
+/// Move the bytes received into the frame being assembled
+///
+/// Returns 1 once the whole frame is there. Until a frame starts, the ring
+/// is searched byte by byte for a prefix. The bytes of the frame and the
+/// ones after it are left in the ring until the frame is released.
+uint8_t rx_parse(rx_stream_t *rx)
+{
+	uint16_t head = rx->head;
+
+	while (rx->next != head && (rx->expected == 0 || rx->num_bytes < rx->expected)) {
+		uint16_t next = rx->next;
+		uint16_t num_bytes;
+
+		if (rx->expected == 0) {
+			if (((head - next) & (RX_RING_SIZE - 1)) < FRAME_PREFIX_SIZE) {
+				break;
+			}
+
+			rx->expected = frame_start(rx, next);
+			if (rx->expected == 0) {
+				rx->next = rx->tail = (next + 1) & (RX_RING_SIZE - 1);
+				continue;
+			}
+		}
+
+		// Copy up to the end of the frame, the end of the bytes received or
+		// the end of the ring, whichever comes first
+		num_bytes = ((head > next) ? head : RX_RING_SIZE) - next;
+		if (num_bytes > rx->expected - rx->num_bytes) {
+			num_bytes = rx->expected - rx->num_bytes;
+		}
+
+		memcpy(rx->frame + rx->num_bytes, rx->ring + next, num_bytes);
+		rx->num_bytes += num_bytes;
+		rx->next = (next + num_bytes) & (RX_RING_SIZE - 1);
+	}
+
+	return rx->expected != 0 && rx->num_bytes == rx->expected;
+}
+
+/// Start assembling the next frame, once the current one has been handled
+void rx_release(rx_stream_t *rx)
+{
+	rx->tail = rx->next;
+	rx->num_bytes = 0;
+	rx->expected = 0;
+	rx->forwarded = 0;
+}
 
-uint16_t num_bytes_up = 0;
-uint16_t num_bytes_down = 0;
-uint8_t waiting_read_down = 0;
+/// Drop a corrupted frame
+///
+/// A byte lost inside a frame makes it swallow the start of the next one,
+/// so the search for the next frame starts right after the preamble of the
+/// corrupted one, not after its last byte.
+void rx_reject(rx_stream_t *rx)
+{
+	rx->next = rx->tail = (rx->tail + 1) & (RX_RING_SIZE - 1);
+	rx->num_bytes = 0;
+	rx->expected = 0;
+	rx->forwarded = 0;
+}
 
-uint32_t adc_values[2];
-uint8_t write_mem_en = 0;
+/// Drop every byte received, along with the frame being assembled
+void rx_flush(rx_stream_t *rx)
+{
+	rx->next = rx->head;
+	rx_release(rx);
+}
 
+/// Called by the interrupt of a USART for every byte it receives
+void receive_byte(UART_HandleTypeDef *huart, uint8_t byte)
+{
+	rx_push((huart == &huart1) ? &rx_up : &rx_down, byte);
+}
 
 /// Initial peripheral configuration
 void init_configuration(void)
 {
-	HAL_UART_Receive_IT(&huart1, (uint8_t *)&up_buffer, 15);
-	HAL_UART_Receive_IT(&huart3, (uint8_t *)&down_buffer, 15);
+	// Every byte received raises an interrupt, the USARTs are never armed
+	// for a given number of bytes
+	__HAL_UART_ENABLE_IT(&huart1, UART_IT_RXNE);
+	__HAL_UART_ENABLE_IT(&huart3, UART_IT_RXNE);
 
 //	__HAL_ADC_ENABLE(&hadc);
 //	HAL_ADC_Start(&hadc);
 }
 
 
-void transmit_buffer(uint8_t *buffer, uint16_t num_bytes)
+/// Wait for the frame being sent through a USART to finish
+///
+/// If it takes longer than TIMEOUT_TX the transmission is aborted.
+static void wait_tx_done(UART_HandleTypeDef *huart)
 {
-	for(int i = 0; i < num_bytes; ++i) {
-		HAL_UART_Transmit(&huart1, (buffer + i), 1, TIMEOUT_TX);
+	uint32_t start;
+
+	if (huart->gState == HAL_UART_STATE_READY) {
+		return;
+	}
+
+	start = HAL_GetTick();
+	while (huart->gState != HAL_UART_STATE_READY) {
+		if (HAL_GetTick() - start > TIMEOUT_TX) {
+			HAL_UART_AbortTransmit(huart);
+			break;
+		}
 	}
 }
 
-/// Parse a header from the received bytes
-uint8_t parse_header(uint8_t *usart_buffer, header_t *header)
+/// Get the buffer for the next frame sent through a USART
+///
+/// Waits for the frame being sent to finish, since the DMA reads the frame
+/// from this buffer.
+static uint8_t *acquire_tx_buffer(UART_HandleTypeDef *huart)
 {
-	header->type = usart_buffer[0];
-	header->ttl = usart_buffer[1];
-	header->crc = usart_buffer[2];
+	wait_tx_done(huart);
 
-	header->bid_high = (usart_buffer[6] << 24) + (usart_buffer[5] << 16) + (usart_buffer[4] << 8) + (usart_buffer[3]);
-	header->bid_medium = (usart_buffer[10] << 24) + (usart_buffer[9] << 16) + (usart_buffer[8] << 8) + (usart_buffer[7]);
-	header->bid_low = (usart_buffer[14] << 24) + (usart_buffer[13] << 16) + (usart_buffer[12] << 8) + (usart_buffer[11]);
+	return (huart == &huart1) ? tx_buffer_up : tx_buffer_down;
+}
 
-	return 1;
+/// Send a whole frame with a single DMA transfer
+///
+/// The frame is copied, so the buffer can be reused as soon as this returns.
+void transmit_frame(UART_HandleTypeDef *huart, uint8_t *frame, uint16_t num_bytes)
+{
+	uint8_t *tx_buffer = acquire_tx_buffer(huart);
+
+	memcpy(tx_buffer, frame, num_bytes);
+	HAL_UART_Transmit_DMA(huart, tx_buffer, num_bytes);
 }
 
-uint8_t parse_body(uint8_t *buffer, body_t *body) {
+void transmit_buffer(uint8_t *buffer, uint16_t num_bytes)
+{
+	transmit_frame(&huart1, buffer, num_bytes);
+}
 
-	body->type = buffer[0];
-	body->crc = buffer[1];
+/// Send on the bytes of a frame received since the last chunk
+///
+/// A chunk takes as long to send as the next one takes to arrive, so the
+/// frame leaves the board one chunk behind the bytes coming in.
+static void forward_chunk(UART_HandleTypeDef *huart, uint8_t *buffer,
+		uint16_t num_bytes, uint16_t *forwarded)
+{
+	if (num_bytes > *forwarded) {
+		transmit_frame(huart, buffer + *forwarded, num_bytes - *forwarded);
+		*forwarded = num_bytes;
+	}
+}
 
-	body->bid_high = (buffer[5] << 24) + (buffer[4] << 16) + (buffer[3] << 8) + (buffer[2]);
-	body->bid_medium = (buffer[9] << 24) + (buffer[8] << 16) + (buffer[7] << 8) + (buffer[6]);
-	body->bid_low = (buffer[13] << 24) + (buffer[12] << 16) + (buffer[11] << 8) + (buffer[10]);
+/// Check if this board can send a frame of its own up the chain
+///
+/// Frames from down the chain are passed up in chunks, so a frame of this
+/// board would cut into the one being passed up. It waits for it to be
+/// complete instead. A frame that stops arriving halfway is dropped after
+/// TIMEOUT_TX, the station finds the next one by its preamble.
+static uint8_t up_link_free(void)
+{
+	uint32_t now;
 
-	switch (body->type) {
-	case MEMORY:
-                body->mem_address = (buffer[15] << 8) + (buffer[14]);
+	if (rx_down.forwarded == 0) {
+		up_link_waiting = 0;
+		return 1;
+	}
 
-                for(int i = 0; i < 512; ++i) {
-                        body->data[i] = buffer[16 + i];
-                }
-		break;
-	case SENSORS:
-		break;
-	case CODE:
-		break;
+	now = HAL_GetTick();
+	if (!up_link_waiting) {
+		up_link_waiting = 1;
+		up_link_waiting_since = now;
+	} else if (now - up_link_waiting_since > TIMEOUT_TX) {
+		rx_reject(&rx_down);
+		up_link_waiting = 0;
+		return 1;
 	}
+	return 0;
+}
 
-	return 1;
+/// Check if enough bytes of a frame arrived to send on a chunk
+static uint8_t chunk_ready(uint16_t num_bytes, uint16_t expected, uint16_t forwarded)
+{
+	return forward_chunk_size && num_bytes < expected && num_bytes > forwarded
+			&& num_bytes - forwarded >= forward_chunk_size;
+}
+
+/// Parse a header from the received bytes
+///
+/// The layout of the packed struct matches the bytes on the wire.
+/// Returns 0 if the CRC does not match.
+uint8_t parse_header(uint8_t *usart_buffer, header_t *header)
+{
+	memcpy(header, usart_buffer, HEADER_SIZE);
+
+	return header->crc == header_crc(header);
+}
+
+/// Parse a body from the received bytes
+///
+/// Returns 0 if the CRC does not match.
+uint8_t parse_body(uint8_t *buffer, body_t *body) {
+
+	memcpy(body, buffer, BODY_SIZE);
+
+	return body->crc == body_crc(body);
 }
 
 ///
@@ -97,60 +430,54 @@ void register_uid(void)
 }
 
 uint32_t get_bid_high() {
-	uint8_t *uid_p = (uint8_t *)0x1FF800D0;
+	uint8_t *uid_p = (uint8_t *)UID_BASE;
 
 	return ((uint8_t)*(uid_p)<< 24) + ((uint8_t)*(uid_p + 1) << 16) + ((uint8_t)*(uid_p + 2) << 8) + ((uint8_t)*(uid_p + 3));
 }
 
 uint32_t get_bid_medium() {
-	uint8_t *uid_p = (uint8_t *)0x1FF800D0;
+	uint8_t *uid_p = (uint8_t *)UID_BASE;
 
 	return ((uint8_t)*(uid_p + 4)<< 24) + ((uint8_t)*(uid_p + 5) << 16) + ((uint8_t)*(uid_p + 6) << 8) + ((uint8_t)*(uid_p + 7));
 }
 
 uint32_t get_bid_low() {
-	uint8_t *uid_p = (uint8_t *)0x1FF800e3;
+	uint8_t *uid_p = (uint8_t *)(UID_BASE + 0x13);
 
 	return ((uint8_t)*(uid_p)<< 24) + ((uint8_t)*(uid_p + 1) << 16) + ((uint8_t)*(uid_p + 2) << 8) + ((uint8_t)*(uid_p + 3));
 }
 
 void transmit_header(UART_HandleTypeDef *huart, header_t *header) {
-        HAL_UART_Transmit(huart, (uint8_t *)&header->type, 1, TIMEOUT_TX);
-        HAL_UART_Transmit(huart, (uint8_t *)&header->ttl, 1, TIMEOUT_TX);
+        header->sync = FRAME_SYNC;
+        header->length = HEADER_SIZE;
 
-        HAL_UART_Transmit(huart, (uint8_t *)&header->crc, 1, TIMEOUT_TX);
+        // Fields may have changed on the way, e.g. TTL or type
+        header->crc = header_crc(header);
 
-        HAL_UART_Transmit(huart, (uint8_t *)&header->bid_high, 4, TIMEOUT_TX);
-        HAL_UART_Transmit(huart, (uint8_t *)&header->bid_medium, 4, TIMEOUT_TX);
-        HAL_UART_Transmit(huart, (uint8_t *)&header->bid_low, 4, TIMEOUT_TX);
+        transmit_frame(huart, (uint8_t *)header, HEADER_SIZE);
 }
 
 void transmit_body(UART_HandleTypeDef *huart, body_t *body) {
-	// Read body to check which regions of memory to read
-	// Send header to inform master of the read data
-	HAL_UART_Transmit(huart, (uint8_t *)&body->type, 1, TIMEOUT_TX);
-	HAL_UART_Transmit(huart, (uint8_t *)&body->crc, 1, TIMEOUT_TX);
-
-	HAL_UART_Transmit(huart, (uint8_t *)&body->bid_high, 4, TIMEOUT_TX);
-	HAL_UART_Transmit(huart, (uint8_t *)&body->bid_medium, 4, TIMEOUT_TX);
-	HAL_UART_Transmit(huart, (uint8_t *)&body->bid_low, 4, TIMEOUT_TX);
-
-	HAL_UART_Transmit(huart, (uint8_t *)&body->mem_address, 2, TIMEOUT_TX);
-
-	uint8_t *mem = (uint8_t *)0x20000000;
+	uint8_t *mem = (uint8_t *)SRAM_BASE;
 	uint32_t address = body->mem_address * 512;
 
-	switch(body->type) {
-		case MEMORY:
-			for(int i = 0; i < 512; i++) {
-				HAL_UART_Transmit(huart, (uint8_t *)(mem + address + i), 1, TIMEOUT_TX);
-			}
-			break;
-		case SENSORS:
-			break;
-		case CODE:
-			break;
+	// The frame is built in the DMA buffer, with the data copied straight
+	// from SRAM for memory reads
+	uint8_t *frame = acquire_tx_buffer(huart);
+	body_t *frame_body = (body_t *)frame;
+
+	memcpy(frame, body, offsetof(body_t, data));
+	frame_body->sync = FRAME_SYNC;
+	frame_body->length = BODY_SIZE;
+	if (body->type == MEMORY) {
+		// The region read may hold the DMA buffer itself
+		memmove(frame_body->data, mem + address, 512);
+	} else {
+		memcpy(frame_body->data, body->data, 512);
 	}
+	frame_body->crc = body_crc(frame_body);
+
+	HAL_UART_Transmit_DMA(huart, frame, BODY_SIZE);
 
 	// TODO: Implement sensors readout
 //	uint16_t *vdd_cal = (uint16_t *)0x1FF800F8;
@@ -166,7 +493,7 @@ void transmit_body(UART_HandleTypeDef *huart, body_t *body) {
 /// Write the values to memory
 void write_mem_values(body_t *body) {
 
-        uint8_t *mem = (uint8_t *)0x20000000;
+        uint8_t *mem = (uint8_t *)SRAM_BASE;
         uint32_t address = body->mem_address * 512;
 
         for(int i = 0; i < 512; i++) {
@@ -175,6 +502,114 @@ void write_mem_values(body_t *body) {
 }
 
 
+/// Check if a packet is addressed to this board
+static uint8_t is_target(uint32_t bid_high, uint32_t bid_medium, uint32_t bid_low)
+{
+	return bid_high == get_bid_high() && bid_medium == get_bid_medium() && bid_low == get_bid_low();
+}
+
+/// Check if both USARTs can run at a baud rate
+///
+/// BRR holds the clock divider in sixteenths, which must be at least 16
+/// with oversampling by 16. The rate obtained must be within 2% of the one
+/// asked for.
+static uint8_t baud_supported(uint32_t rate)
+{
+	uint32_t pclks[] = { HAL_RCC_GetPCLK2Freq(), HAL_RCC_GetPCLK1Freq() };
+
+	if (rate < BAUD_MIN) {
+		return 0;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		uint32_t brr = (pclks[i] + rate / 2) / rate;
+		uint32_t actual = pclks[i] / brr;
+		uint32_t error = (actual > rate) ? actual - rate : rate - actual;
+
+		if (brr < 16 || error * 50 > rate) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/// Switch both USARTs to a baud rate
+///
+/// Frames being sent are finished first, at the old rate. Any byte received
+/// and not handled yet is dropped.
+static void switch_baud_rate(uint32_t rate)
+{
+	UART_HandleTypeDef *uarts[] = { &huart1, &huart3 };
+
+	for (int i = 0; i < 2; i++) {
+		wait_tx_done(uarts[i]);
+
+		uarts[i]->Init.BaudRate = rate;
+		HAL_UART_Init(uarts[i]);
+		__HAL_UART_ENABLE_IT(uarts[i], UART_IT_RXNE);
+	}
+
+	rx_flush(&rx_up);
+	rx_flush(&rx_down);
+}
+
+/// Switch to the baud rate of a BAUD commit
+///
+/// The new rate is kept only if a header arrives intact before
+/// BAUD_CONFIRM_MS, otherwise the board goes back to the previous one.
+/// Going back to the rate the board is running at confirms it.
+static void commit_baud_rate(uint32_t rate)
+{
+	uint32_t current = huart1.Init.BaudRate;
+
+	if (rate == current) {
+		fallback_baud_rate = 0;
+	} else if (baud_supported(rate)) {
+		switch_baud_rate(rate);
+		fallback_baud_rate = current;
+		baud_switched_at = HAL_GetTick();
+	}
+}
+
+/// Check if the blocks of a RANGE_READ or DIGEST argument are all in SRAM
+static uint8_t range_in_sram(uint32_t arg)
+{
+	return (uint32_t)RANGE_OFFSET(arg) + RANGE_NUM_BLOCKS(arg) <= SRAM_NUM_BLOCKS;
+}
+
+/// Send the next frame of a range read up the chain
+///
+/// Every block is sent as a MEMORY body with its own CRC, and the range
+/// ends with a RANGE_END header carrying the number of blocks sent.
+static void stream_range(void)
+{
+	if (range_left == 0) {
+		header_t trailer = {
+			.type = RANGE_END,
+			.seq = range_seq,
+			.bid_high = get_bid_high(),
+			.bid_medium = get_bid_medium(),
+			.bid_low = get_bid_low(),
+			.arg = range_num_blocks,
+		};
+
+		transmit_header(&huart1, &trailer);
+		range_streaming = 0;
+		return;
+	}
+
+	body.type = MEMORY;
+	body.seq = range_seq;
+	body.bid_high = get_bid_high();
+	body.bid_medium = get_bid_medium();
+	body.bid_low = get_bid_low();
+	body.mem_address = range_next;
+	transmit_body(&huart1, &body);
+
+	range_next++;
+	range_left--;
+}
+
 void transmit_ACK(header_t *header) {
 	header->type = ACK;
 	transmit_header(&huart1, header);
@@ -203,7 +638,9 @@ SystemState header_handler(header_t *header) {
 			header->bid_low = get_bid_low();
 	    	transmit_ACK(header);
 
-	    	HAL_Delay(1000);
+	    	if (handshake_delay_ms) {
+	    		HAL_Delay(handshake_delay_ms);
+	    	}
 
 	    	header->type = PING;
 	    	header->bid_high = 0;
@@ -213,7 +650,7 @@ SystemState header_handler(header_t *header) {
 	    	// Transport PING packet down the chain
 	    	transmit_header(&huart3, header);
 
-		} else if(header->bid_high == get_bid_high() && header->bid_medium == get_bid_medium() && header->bid_low == get_bid_low() ) {
+		} else if (is_target(header->bid_high, header->bid_medium, header->bid_low)) {
 //			HAL_GPIO_WritePin(LED_1_GPIO_Port, LED_1_Pin, GPIO_PIN_SET);
 	    	transmit_ACK(header);
 	    } else {
@@ -221,66 +658,128 @@ SystemState header_handler(header_t *header) {
 	    	transmit_header(&huart3, header);
 	    }
 
-		num_bytes_up = 0;
-		HAL_UART_Receive_IT(&huart1, (uint8_t *)&up_buffer, 15);
-
-		num_bytes_down = 0;
-		HAL_UART_Receive_IT(&huart3, (uint8_t *)&down_buffer, 15);
-
 		return Idle_State;
 
 		break;
 
 	case READ:
-		// Wait to receive body
-		write_mem_en = 0;
-		num_bytes_up = 0;
-		HAL_UART_Receive_IT(&huart1, (uint8_t *)&up_buffer, MAX_BUFFER_SIZE);
+	case WRITE:
+		// The body is kept in the ring from its first byte, so the ACK
+		// tells the station that it can be sent
+		write_mem_en = (header->type == WRITE);
 
 		// Reply to packet
-		if(header->bid_high == get_bid_high() && header->bid_medium == get_bid_medium() && header->bid_low == get_bid_low() ) {
+		if (is_target(header->bid_high, header->bid_medium, header->bid_low)) {
 			transmit_ACK(header);
-			HAL_Delay(1000);
 
-			waiting_read_down = 0;
-			return Read_Region_State;
+			if (handshake_delay_ms) {
+				HAL_Delay(handshake_delay_ms);
+			}
 		} else {
 			// Send packet down to next board in the chain
 			transmit_header(&huart3, header);
 
-			// Wait for ACK of the board
-			num_bytes_down = 0;
-			HAL_UART_Receive_IT(&huart3, (uint8_t *)&down_buffer, 15);
-
-			waiting_read_down = 1;
-			return Idle_State;
+			// The body is for the target, pass it on as it arrives
+			forwarding_up = 1;
 		}
+		return Idle_State;
 		break;
 
-	case WRITE:
-		// Wait to receive body
-		num_bytes_up = 0;
-		HAL_UART_Receive_IT(&huart1, (uint8_t *)&up_buffer, MAX_BUFFER_SIZE);
-		write_mem_en = 1;
+	case BAUD:
+		if (header->arg & BAUD_COMMIT) {
+			// Pass the commit on at the current rate before switching
+			transmit_header(&huart3, header);
+			commit_baud_rate(header->arg & ~BAUD_COMMIT);
+		} else {
+			uint32_t rate = header->arg;
 
-		// Reply to packet
-		if(header->bid_high == get_bid_high() && header->bid_medium == get_bid_medium() && header->bid_low == get_bid_low() ) {
+			// Tell the station if this board supports the rate, as for a PING
+			header->ttl += 1;
+			header->bid_high = get_bid_high();
+			header->bid_medium = get_bid_medium();
+			header->bid_low = get_bid_low();
+			header->arg = baud_supported(rate) ? rate : 0;
 			transmit_ACK(header);
-			HAL_Delay(1000);
 
-			waiting_read_down = 0;
-			return Read_Region_State;
+			header->type = BAUD;
+			header->bid_high = 0;
+			header->bid_medium = 0;
+			header->bid_low = 0;
+			header->arg = rate;
+			transmit_header(&huart3, header);
+		}
+		return Idle_State;
+		break;
+
+	case RANGE_READ:
+		if (is_target(header->bid_high, header->bid_medium, header->bid_low)) {
+			// The blocks are sent from the main loop as the USART frees up.
+			// A range past the end of SRAM gets the trailer alone, with
+			// no blocks sent.
+			range_next = RANGE_OFFSET(header->arg);
+			range_num_blocks = range_in_sram(header->arg) ?
+					RANGE_NUM_BLOCKS(header->arg) : 0;
+			range_left = range_num_blocks;
+			range_seq = header->seq;
+			range_streaming = 1;
 		} else {
-			// Send packet down to next board in the chain
+			// The blocks come back to back, followed by the trailer
 			transmit_header(&huart3, header);
+		}
+		return Idle_State;
+		break;
 
-			// Wait for ACK of the board
-			num_bytes_down = 0;
-			HAL_UART_Receive_IT(&huart3, (uint8_t *)&down_buffer, 15);
+	case DIGEST:
+		if (is_target(header->bid_high, header->bid_medium, header->bid_low)) {
+			// The digest goes back in the ACK, no body is needed
+			uint8_t *mem = (uint8_t *)SRAM_BASE;
+
+			if (!range_in_sram(header->arg)) {
+				// Refused as a range read is, with an empty trailer
+				header->type = RANGE_END;
+				header->arg = 0;
+				transmit_header(&huart1, header);
+				return Idle_State;
+			}
 
-			waiting_read_down = 1;
-			return Idle_State;
+			header->arg = digest_update(DIGEST_INIT,
+					mem + RANGE_OFFSET(header->arg) * 512,
+					RANGE_NUM_BLOCKS(header->arg) * 512);
+			transmit_ACK(header);
+		} else {
+			transmit_header(&huart3, header);
 		}
+		return Idle_State;
+		break;
+
+	case COLLECT:
+		header->ttl += 1;
+
+		if (COLLECT_OFFSET(header->arg) >= SRAM_NUM_BLOCKS) {
+			// A block past the end of SRAM is refused without reading it.
+			// The boards below refuse it too, so every board still answers.
+			header_t nack = *header;
+			nack.type = NACK;
+			nack.bid_high = get_bid_high();
+			nack.bid_medium = get_bid_medium();
+			nack.bid_low = get_bid_low();
+			transmit_header(&huart1, &nack);
+		} else {
+			// Every board answers with its own block, ahead of the ones below
+			body.type = MEMORY;
+			body.seq = header->seq;
+			body.bid_high = get_bid_high();
+			body.bid_medium = get_bid_medium();
+			body.bid_low = get_bid_low();
+			body.mem_address = COLLECT_OFFSET(header->arg);
+			transmit_body(&huart1, &body);
+		}
+
+		// The boards below answer once the block has been sent, so their
+		// blocks never wait for USART1 to be free
+		collect_header = *header;
+		collect_pending = (COLLECT_NUM_BOARDS(header->arg) > header->ttl);
+		return Idle_State;
 		break;
 
 	case EXEC:
@@ -297,19 +796,16 @@ SystemState body_handler(body_t *body)
 	switch(body->type) {
 	case MEMORY:
 
-		if(write_mem_en == 1) {
+		if (!is_target(body->bid_high, body->bid_medium, body->bid_low)) {
+			// Send the body down to the target. The answer to a READ comes
+			// back through Transport_State
+			transmit_frame(&huart3, (uint8_t *)body, BODY_SIZE);
+		} else if(write_mem_en == 1) {
 			write_mem_values(body);
 		} else {
 			transmit_body(&huart1, body);
 		}
 
-		// Prepare to receive headers
-		num_bytes_down = 0;
-		HAL_UART_Receive_IT(&huart3, (uint8_t *)&down_buffer, 15);
-
-		num_bytes_up = 0;
-		HAL_UART_Receive_IT(&huart1, (uint8_t *)&up_buffer, 15);
-
 		return Idle_State;
 
 		break;
@@ -321,3 +817,116 @@ SystemState body_handler(body_t *body)
 		return Idle_State;
 	}
 }
+
+/// Drop a packet whose CRC does not match
+///
+/// The transaction is aborted and the board waits for a new header. The
+/// main loop looks for the next frame among the bytes of this one.
+SystemState crc_error_handler(void)
+{
+	forwarding_up = 0;
+
+	return Idle_State;
+}
+
+/// Run one iteration of the main loop
+///
+/// Each slave makes use of two USARTs, being those 1 and 3
+///   USART1 will be used to receive data
+///   USART3 will be used to transmit data
+///
+/// The package should go up the chain without any type of intervention
+void protocol_poll(void)
+{
+	switch (curr_state) {
+	case Idle_State:
+		break;
+
+	case Read_Header_State:
+		// A header ends the transaction of the previous one
+		forwarding_up = 0;
+
+		if (!parse_header(rx_up.frame, &header)) {
+			next_state = crc_error_handler();
+			rx_reject(&rx_up);
+			break;
+		}
+
+		// A header arriving intact confirms the baud rate
+		fallback_baud_rate = 0;
+		next_state = header_handler(&header);
+		rx_release(&rx_up);
+		break;
+
+	case Read_Region_State:
+	case Read_Sensors_State:
+		if (forwarding_up) {
+			// Checked by the target, only the rest of the frame is sent on
+			forwarding_up = 0;
+			forward_chunk(&huart3, rx_up.frame, rx_up.num_bytes, &rx_up.forwarded);
+			next_state = Idle_State;
+			rx_release(&rx_up);
+		} else if (!parse_body(rx_up.frame, &body)) {
+			next_state = crc_error_handler();
+			rx_reject(&rx_up);
+		} else {
+			next_state = body_handler(&body);
+			rx_release(&rx_up);
+		}
+		break;
+
+	case Transport_State:
+		// Frames from down the chain are always passed up, the ones that
+		// follow wait in the ring meanwhile
+		forward_chunk(&huart1, rx_down.frame, rx_down.num_bytes, &rx_down.forwarded);
+		rx_release(&rx_down);
+
+		next_state = Idle_State;
+		break;
+
+	case Execute_Code_State:
+		break;
+	default:
+		break;
+	}
+
+	// The kind of frame is known from its first byte, and it is handled
+	// once all of its bytes arrived. Handling it may send frames up, so it
+	// waits for the frame being passed up.
+	if (rx_parse(&rx_up) && up_link_free()) {
+		next_state = (rx_up.expected == HEADER_SIZE) ? Read_Header_State : Read_Region_State;
+	} else if (rx_parse(&rx_down)) {
+		next_state = Transport_State;
+	}
+	curr_state = next_state;
+
+	// Cut-through, frames being passed on leave as they arrive. A frame from
+	// down the chain only starts to leave this way if no frame of this board
+	// is about to be sent up, otherwise it is passed up whole.
+	if (chunk_ready(rx_down.num_bytes, rx_down.expected, rx_down.forwarded)
+			&& (rx_down.forwarded || (curr_state == Idle_State && !range_streaming))) {
+		forward_chunk(&huart1, rx_down.frame, rx_down.num_bytes, &rx_down.forwarded);
+	}
+	if (forwarding_up && rx_up.expected == BODY_SIZE
+			&& chunk_ready(rx_up.num_bytes, rx_up.expected, rx_up.forwarded)) {
+		forward_chunk(&huart3, rx_up.frame, rx_up.num_bytes, &rx_up.forwarded);
+	}
+
+	// The boards below are asked for their blocks once this one is sent
+	if (collect_pending && huart1.gState == HAL_UART_STATE_READY) {
+		collect_pending = 0;
+		transmit_header(&huart3, &collect_header);
+	}
+
+	// Frames of a range read are sent once the previous one is done
+	if (range_streaming && huart1.gState == HAL_UART_STATE_READY && up_link_free()) {
+		stream_range();
+	}
+
+	// Nothing arrived at the new baud rate, the chain is not using it
+	if (fallback_baud_rate && HAL_GetTick() - baud_switched_at > BAUD_CONFIRM_MS) {
+		switch_baud_rate(fallback_baud_rate);
+		fallback_baud_rate = 0;
+		curr_state = Idle_State;
+	}
+}
@@ -0,0 +1,304 @@
+/*
+ * chain.c
+ *
+ * Chain of boards running protocol.c on the host.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chain.h"
+
+extern UART_HandleTypeDef huart1;
+extern UART_HandleTypeDef huart3;
+extern uint32_t handshake_delay_ms;
+extern uint16_t forward_chunk_size;
+
+extern uint8_t __start_board_state[];
+extern uint8_t __stop_board_state[];
+
+board_t boards[MAX_BOARDS];
+int num_boards;
+
+link_t down[MAX_BOARDS + 1];
+link_t up[MAX_BOARDS + 1];
+
+uint64_t now;
+uint32_t station_rate;
+void (*station_receive)(uint8_t byte) = NULL;
+
+uint64_t wire_byte_ns = 0;
+uint64_t wire_jitter_ns = 0;
+double wire_loss = 0;
+
+static int current = -1;
+
+/// Time the main loop of the current board has reached
+static uint64_t cursor;
+
+/// Initial contents of the board_state section
+static uint8_t *pristine_state;
+
+static size_t state_size(void)
+{
+	return __stop_board_state - __start_board_state;
+}
+
+static void switch_board(int b)
+{
+	if (current == b)
+		return;
+	if (current >= 0)
+		memcpy(boards[current].state, __start_board_state, state_size());
+	memcpy(__start_board_state, boards[b].state, state_size());
+	current = b;
+}
+
+static uint64_t byte_ns(uint32_t rate)
+{
+	return wire_byte_ns ? wire_byte_ns : BYTE_NS(rate);
+}
+
+/// A lost byte still takes its time on the wire
+void link_send(link_t *link, uint64_t at, const uint8_t *data, uint16_t size,
+		uint32_t rate)
+{
+	uint64_t start = at > link->free_at ? at : link->free_at;
+
+	if (wire_jitter_ns)
+		start += (uint64_t)rand() % wire_jitter_ns;
+
+	for (uint16_t i = 0; i < size; i++) {
+		uint32_t slot;
+
+		if (wire_loss > 0 && rand() < wire_loss * RAND_MAX)
+			continue;
+
+		slot = link->tail++ % LINK_SIZE;
+		link->bytes[slot] = data[i];
+		link->arrival[slot] = start + (i + 1) * byte_ns(rate);
+		link->rate[slot] = rate;
+	}
+	link->free_at = start + size * byte_ns(rate);
+}
+
+uint8_t link_pending(link_t *link)
+{
+	return link->head != link->tail;
+}
+
+uint32_t link_room(link_t *link)
+{
+	return LINK_SIZE - (link->tail - link->head);
+}
+
+static uint64_t link_next(link_t *link)
+{
+	return link->arrival[link->head % LINK_SIZE];
+}
+
+/// A byte sent at another baud rate than the receiver's arrives garbled
+static uint8_t link_pop(link_t *link, uint32_t rate)
+{
+	uint32_t slot = link->head++ % LINK_SIZE;
+
+	return (link->rate[slot] == rate) ? link->bytes[slot] : link->bytes[slot] ^ 0xA5;
+}
+
+/// USART1 sends up the chain, USART3 down the chain
+static link_t *tx_link(UART_HandleTypeDef *huart)
+{
+	return (huart == &huart1) ? &up[current] : &down[current + 1];
+}
+
+/// The DMA of a USART is done once its frame is on the wire
+static void update_tx_state(void)
+{
+	UART_HandleTypeDef *uarts[] = { &huart1, &huart3 };
+
+	for (int i = 0; i < 2; i++) {
+		if (uarts[i]->gState == HAL_UART_STATE_BUSY_TX && tx_link(uarts[i])->free_at <= cursor)
+			uarts[i]->gState = HAL_UART_STATE_READY;
+	}
+}
+
+/// Time the first USART of the current board still sending is done
+static uint64_t next_tx_done(void)
+{
+	UART_HandleTypeDef *uarts[] = { &huart1, &huart3 };
+	uint64_t done = UINT64_MAX;
+
+	for (int i = 0; i < 2; i++) {
+		if (uarts[i]->gState == HAL_UART_STATE_BUSY_TX && tx_link(uarts[i])->free_at < done)
+			done = tx_link(uarts[i])->free_at;
+	}
+	return done;
+}
+
+static void board_tx(UART_HandleTypeDef *huart, const uint8_t *data, uint16_t size)
+{
+	link_send(tx_link(huart), cursor, data, size, huart->Init.BaudRate);
+	huart->gState = HAL_UART_STATE_BUSY_TX;
+}
+
+/// The main loop of the board is blocked, but not its interrupts
+static void board_delay(uint32_t ms)
+{
+	cursor += ms * NS_PER_MS;
+	host_tick = cursor / NS_PER_MS;
+	update_tx_state();
+}
+
+/// The board only reads the tick in a loop while it waits for a USART, so
+/// time moves on to when the next frame is on the wire
+static void board_tick_read(void)
+{
+	uint64_t done = next_tx_done();
+
+	if (done != UINT64_MAX && done > cursor)
+		cursor = done;
+	host_tick = cursor / NS_PER_MS;
+	update_tx_state();
+}
+
+/// Run the main loop of a board until it has nothing left to do
+static void wake_board(int b)
+{
+	if (boards[b].ready_at > now)
+		return;
+
+	switch_board(b);
+	cursor = now;
+	host_tick = now / NS_PER_MS;
+	update_tx_state();
+
+	// A frame takes three iterations: detect, handle, settle. Several may
+	// be waiting in the ring of a board that was blocked.
+	for (int i = 0; i < 16 && cursor == now; i++) {
+		protocol_poll();
+	}
+	update_tx_state();
+
+	// The board is woken up again once it is no longer blocked, or once a
+	// USART is done sending, as the main loop keeps polling
+	boards[b].ready_at = cursor;
+	boards[b].wake_at = (cursor > now) ? cursor : next_tx_done();
+	boards[b].wake_pending = (boards[b].wake_at != UINT64_MAX);
+}
+
+/// Deliver a byte as the RXNE interrupt of the board would
+static void deliver(int b, UART_HandleTypeDef *huart, link_t *link)
+{
+	switch_board(b);
+	receive_byte(huart, link_pop(link, huart->Init.BaudRate));
+	wake_board(b);
+}
+
+/// Set up a chain of boards, with the memory of each left to the caller
+void chain_init(int size)
+{
+	num_boards = size;
+
+	pristine_state = malloc(state_size());
+	memcpy(pristine_state, __start_board_state, state_size());
+
+	for (int b = 0; b < num_boards; b++) {
+		boards[b].state = malloc(state_size());
+	}
+
+	host_uart_tx = board_tx;
+	host_delay = board_delay;
+	host_tick_read = board_tick_read;
+}
+
+/// Power cycle every board and clear the lines
+void chain_reset(uint32_t delay_ms, uint16_t chunk_size)
+{
+	memset(down, 0, sizeof(down));
+	memset(up, 0, sizeof(up));
+	now = 0;
+	current = -1;
+	station_rate = BAUD_RATE;
+	handshake_delay_ms = delay_ms;
+	forward_chunk_size = chunk_size;
+
+	for (int b = 0; b < num_boards; b++) {
+		memcpy(boards[b].state, pristine_state, state_size());
+		boards[b].ready_at = 0;
+		boards[b].wake_pending = 0;
+
+		switch_board(b);
+		host_sram = boards[b].sram;
+		host_uid = boards[b].uid;
+		init_configuration();
+	}
+}
+
+/// Time of the next event, UINT64_MAX if there is nothing left to happen
+///
+/// The link or the board of the event is stored if asked for.
+static uint64_t find_event(link_t **event_link, int *event_target)
+{
+	uint64_t next = UINT64_MAX;
+	link_t *link = NULL;
+	int target = 0;
+
+	for (int b = 0; b <= num_boards; b++) {
+		if (b < num_boards && link_pending(&down[b]) && link_next(&down[b]) < next) {
+			next = link_next(&down[b]);
+			link = &down[b];
+			target = b;
+		}
+		if (link_pending(&up[b]) && link_next(&up[b]) < next) {
+			next = link_next(&up[b]);
+			link = &up[b];
+			target = b;
+		}
+	}
+	for (int b = 0; b < num_boards; b++) {
+		if (boards[b].wake_pending && boards[b].wake_at < next) {
+			next = boards[b].wake_at;
+			link = NULL;
+			target = b;
+		}
+	}
+
+	if (event_link)
+		*event_link = link;
+	if (event_target)
+		*event_target = target;
+	return next;
+}
+
+uint64_t next_event(void)
+{
+	return find_event(NULL, NULL);
+}
+
+/// Advance the chain to the next event
+///
+/// Returns 0 if there is nothing left to happen.
+uint8_t step(void)
+{
+	link_t *link;
+	int target;
+	uint64_t next = find_event(&link, &target);
+
+	if (next == UINT64_MAX)
+		return 0;
+
+	now = next;
+	if (link == NULL) {
+		wake_board(target);
+	} else if (link == &up[0]) {
+		uint8_t byte = link_pop(link, station_rate);
+		if (station_receive)
+			station_receive(byte);
+	} else if (link == &up[target]) {
+		// Going up from board target into USART3 of the board above
+		deliver(target - 1, &huart3, link);
+	} else {
+		deliver(target, &huart1, link);
+	}
+	return 1;
+}
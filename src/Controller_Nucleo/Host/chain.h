@@ -0,0 +1,91 @@
+/*
+ * chain.h
+ *
+ * Chain of boards running protocol.c on the host, shared by the simulation
+ * and the emulator.
+ *
+ * Every board runs the real protocol_poll against the HAL stub, with its
+ * own copy of the board_state section. The USARTs are connected in a chain
+ * and the bytes take the time they would take on the wire. Time is counted
+ * in nanoseconds and only moves on from one event to the next, a byte
+ * arriving or a board waking up. A board is blocked while it waits for a
+ * USART to finish sending, as it is on the target.
+ */
+
+#ifndef HOST_CHAIN_H_
+#define HOST_CHAIN_H_
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define MAX_BOARDS 32
+#define BAUD_RATE 115200
+
+/// Time to send one byte, 10 bits per byte
+#define BYTE_NS(rate) (10ULL * 1000000000ULL / (rate))
+
+#define NS_PER_MS 1000000ULL
+
+/// Bytes a line can hold in flight
+#define LINK_SIZE (4 * BODY_SIZE)
+
+/// One direction of a serial line, with the bytes in flight and the baud
+/// rate they were sent at
+typedef struct {
+	uint8_t bytes[LINK_SIZE];
+	uint64_t arrival[LINK_SIZE];
+	uint32_t rate[LINK_SIZE];
+	uint32_t head;
+	uint32_t tail;
+	uint64_t free_at;
+} link_t;
+
+typedef struct {
+	uint8_t *state;
+	uint8_t sram[HOST_SRAM_SIZE];
+	uint8_t uid[HOST_UID_SIZE];
+	uint64_t ready_at;
+	uint64_t wake_at;
+	uint8_t wake_pending;
+} board_t;
+
+extern board_t boards[MAX_BOARDS];
+extern int num_boards;
+
+/// down[i] goes into board i from above, up[i] goes out of board i
+/// upwards. down[0] and up[0] are the lines of the station.
+extern link_t down[MAX_BOARDS + 1];
+extern link_t up[MAX_BOARDS + 1];
+
+/// Time of the last event
+extern uint64_t now;
+
+/// Baud rate of the station, bytes reaching it at another rate arrive
+/// garbled
+extern uint32_t station_rate;
+
+/// Called with every byte reaching the station
+extern void (*station_receive)(uint8_t byte);
+
+/// Time a byte takes on every line, 0 to take it from the baud rate
+extern uint64_t wire_byte_ns;
+
+/// Every frame is sent up to this much later than it could be
+extern uint64_t wire_jitter_ns;
+
+/// Probability of a byte being lost on a line
+extern double wire_loss;
+
+void chain_init(int size);
+void chain_reset(uint32_t delay_ms, uint16_t chunk_size);
+
+void link_send(link_t *link, uint64_t at, const uint8_t *data, uint16_t size,
+		uint32_t rate);
+uint8_t link_pending(link_t *link);
+uint32_t link_room(link_t *link);
+
+uint64_t next_event(void);
+uint8_t step(void);
+
+#endif /* HOST_CHAIN_H_ */
@@ -0,0 +1,367 @@
+/*
+ * chain_emu.c
+ *
+ * Emulation of chains of boards behind pseudo-terminals, so the station can
+ * be run and measured without any board.
+ *
+ * Every chain is a chain of boards running protocol.c, see chain.h, behind
+ * a pty with a link named ttyUSB<n> in a directory, which the station finds
+ * as it finds the USB serial ports of the real chains. The bytes written by
+ * the station enter the chain as they arrive, and the chain runs in step
+ * with the wall clock, so every byte takes the time it would take on the
+ * wire. Each board has its own ID and its own SRAM, filled with random
+ * bytes as after a power up.
+ *
+ * The station is taken to switch to the rate of a BAUD commit once it has
+ * sent it, as it does, so a chain that falls out of step with the station
+ * stops understanding it.
+ *
+ * The lines can be slowed down, made to jitter and to lose bytes, for the
+ * station to be measured under the conditions of a real rack. A single
+ * frame on its way to the station can also be dropped, to test how the
+ * station recovers from it.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "chain.h"
+
+/// Bytes waiting to be read by the station
+#define STATION_OUT_SIZE (16 * BODY_SIZE)
+
+static volatile sig_atomic_t stopping = 0;
+
+static uint8_t station_out[STATION_OUT_SIZE];
+static uint32_t station_out_len;
+static uint32_t station_dropped;
+
+/// Frame from the station being passed down, whose header is kept
+static uint8_t station_frame[HEADER_SIZE];
+static uint32_t station_frame_len;
+
+/// Frame to drop on its way to the station, counted from 1, 0 for none
+static uint32_t drop_frame;
+static uint32_t num_frames;
+
+/// Start of the next frame to the station, held until its size is known
+static uint8_t frame_head[4];
+static uint32_t frame_head_len;
+
+/// Bytes of the current frame to the station still to come
+static uint32_t frame_left;
+static uint8_t frame_dropped;
+
+static void stop(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+/// Bytes are kept until the station reads them, as a USB serial adapter
+/// keeps them until the driver asks for them
+static void station_push(uint8_t byte)
+{
+	if (station_out_len < STATION_OUT_SIZE) {
+		station_out[station_out_len++] = byte;
+	} else {
+		station_dropped++;
+	}
+}
+
+/// Frames are counted by their preamble and size, so the one asked for can
+/// be dropped as a whole. Bytes out of step with the frames go through.
+static void station_store(uint8_t byte)
+{
+	uint16_t length;
+
+	if (drop_frame == 0) {
+		station_push(byte);
+		return;
+	}
+
+	if (frame_left) {
+		frame_left--;
+		if (!frame_dropped)
+			station_push(byte);
+		return;
+	}
+
+	frame_head[frame_head_len++] = byte;
+	if (frame_head[0] != (FRAME_SYNC & 0xFF)
+			|| (frame_head_len > 1 && frame_head[1] != FRAME_SYNC >> 8)) {
+		for (uint32_t i = 0; i < frame_head_len; i++)
+			station_push(frame_head[i]);
+		frame_head_len = 0;
+		return;
+	}
+	if (frame_head_len < sizeof(frame_head))
+		return;
+
+	length = frame_head[2] | (frame_head[3] << 8);
+	frame_head_len = 0;
+	frame_left = length > sizeof(frame_head) ? length - sizeof(frame_head) : 0;
+	frame_dropped = (++num_frames == drop_frame);
+	if (frame_dropped) {
+		printf("frame %u to the station dropped\n", (unsigned)num_frames);
+		fflush(stdout);
+		return;
+	}
+	for (uint32_t i = 0; i < sizeof(frame_head); i++)
+		station_push(frame_head[i]);
+}
+
+/// Pass bytes from the station down the chain
+///
+/// The station writes whole frames, so they are followed from their
+/// preamble and size. The bytes after a BAUD commit go at the new rate.
+static void station_send(uint64_t at, const uint8_t *bytes, uint32_t num_bytes)
+{
+	header_t *header = (header_t *)station_frame;
+	uint32_t sent = 0;
+
+	for (uint32_t i = 0; i < num_bytes; i++) {
+		if (station_frame_len < HEADER_SIZE)
+			station_frame[station_frame_len] = bytes[i];
+		station_frame_len++;
+
+		if ((station_frame_len == 1 && bytes[i] != (FRAME_SYNC & 0xFF))
+				|| (station_frame_len == 2 && bytes[i] != FRAME_SYNC >> 8)) {
+			station_frame_len = 0;
+			continue;
+		}
+		if (station_frame_len <= offsetof(header_t, type)
+				|| station_frame_len < header->length)
+			continue;
+
+		if (header->length == HEADER_SIZE && header->type == BAUD
+				&& (header->arg & BAUD_COMMIT)) {
+			link_send(&down[0], at, bytes + sent, i + 1 - sent, station_rate);
+			sent = i + 1;
+			station_rate = header->arg & ~BAUD_COMMIT;
+		}
+		station_frame_len = 0;
+	}
+
+	if (sent < num_bytes)
+		link_send(&down[0], at, bytes + sent, num_bytes - sent, station_rate);
+}
+
+static uint64_t wall_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Open a pty in raw mode and link it from the directory
+///
+/// Returns the master side, -1 on error. The slave side stays open, so the
+/// master does not fail while the station has the port closed.
+static int open_port(const char *link_path)
+{
+	struct termios tio;
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	int slave;
+
+	if (master < 0 || grantpt(master) || unlockpt(master))
+		return -1;
+
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave < 0)
+		return -1;
+
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	unlink(link_path);
+	if (symlink(ptsname(master), link_path))
+		return -1;
+
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	return master;
+}
+
+/// Run one chain behind a pty until the emulator is stopped
+static int run_chain(const char *link_path, int size, unsigned int seed)
+{
+	int fd = open_port(link_path);
+	uint64_t start = wall_ns();
+
+	if (fd < 0) {
+		perror(link_path);
+		return 1;
+	}
+
+	srand(seed);
+	chain_init(size);
+	for (int b = 0; b < size; b++) {
+		for (uint32_t i = 0; i < HOST_SRAM_SIZE; i++) {
+			boards[b].sram[i] = (uint8_t)rand();
+		}
+		for (uint32_t i = 0; i < HOST_UID_SIZE; i++) {
+			boards[b].uid[i] = (uint8_t)rand();
+		}
+	}
+	chain_reset(0, FORWARD_CHUNK_SIZE);
+	station_receive = station_store;
+
+	printf("%s: %d boards\n", link_path, size);
+	fflush(stdout);
+
+	while (!stopping) {
+		uint64_t wall = wall_ns() - start;
+		uint64_t next;
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		uint8_t bytes[BODY_SIZE];
+		uint32_t room = link_room(&down[0]);
+		int timeout = -1;
+		ssize_t num_bytes;
+
+		// Bytes from the station enter the chain now, or once the line
+		// has room for them
+		num_bytes = read(fd, bytes, room < sizeof(bytes) ? room : sizeof(bytes));
+		if (num_bytes > 0) {
+			station_send(wall > now ? wall : now, bytes, num_bytes);
+		}
+
+		while ((next = next_event()) <= wall) {
+			step();
+		}
+
+		if (station_out_len) {
+			ssize_t written = write(fd, station_out, station_out_len);
+			if (written > 0) {
+				memmove(station_out, station_out + written, station_out_len - written);
+				station_out_len -= written;
+			}
+		}
+
+		if (num_bytes > 0) {
+			continue;
+		}
+		if (next != UINT64_MAX) {
+			uint64_t wait_ms = (next - wall + NS_PER_MS - 1) / NS_PER_MS;
+			timeout = wait_ms < 1000 ? (int)wait_ms : 1000;
+		}
+		if (station_out_len) {
+			pfd.events |= POLLOUT;
+		}
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+	}
+
+	if (station_dropped) {
+		printf("%s: %u bytes dropped, the station did not read them\n",
+				link_path, (unsigned)station_dropped);
+	}
+	unlink(link_path);
+	close(fd);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-c chains] [-n boards] [-d directory] [-w ns per byte]\n"
+			"          [-j jitter in us] [-l loss rate] [-s seed]\n"
+			"          [-x frame to the station to drop]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = "/dev";
+	struct sigaction action = { .sa_handler = stop };
+	pid_t chains[64];
+	int num_chains = 1;
+	int size = 10;
+	unsigned int seed = 1;
+	int opt;
+	int status = 0;
+
+	while ((opt = getopt(argc, argv, "c:n:d:w:j:l:s:x:")) != -1) {
+		switch (opt) {
+		case 'c':
+			num_chains = atoi(optarg);
+			break;
+		case 'n':
+			size = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'w':
+			wire_byte_ns = strtoull(optarg, NULL, 10);
+			break;
+		case 'j':
+			wire_jitter_ns = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 'l':
+			wire_loss = atof(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			drop_frame = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (num_chains < 1 || num_chains > 64 || size < 1 || size > MAX_BOARDS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Not restarted, so that waiting is interrupted
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	// The boards of a chain share the state of the process, so every chain
+	// runs in a process of its own
+	for (int c = 0; c < num_chains; c++) {
+		chains[c] = fork();
+		if (chains[c] == 0) {
+			char link_path[4096];
+
+			snprintf(link_path, sizeof(link_path), "%s/ttyUSB%d", dir, c);
+			return run_chain(link_path, size, seed + c);
+		}
+	}
+
+	for (int c = 0; c < num_chains; c++) {
+		int chain_status;
+
+		while (wait(&chain_status) < 0) {
+			if (errno != EINTR)
+				return 1;
+			// Links are only removed by the chains themselves
+			for (int k = 0; k < num_chains; k++) {
+				kill(chains[k], SIGTERM);
+			}
+		}
+		if (!WIFEXITED(chain_status) || WEXITSTATUS(chain_status)) {
+			status = 1;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,442 @@
+/*
+ * chain_sim.c
+ *
+ * Simulation on the host of a chain of boards running protocol.c, see
+ * chain.h. The station is simulated as well: it discovers the chain with a
+ * PING and then reads one block from every board, waiting for the ACK
+ * before sending the body, the same block from every board with a single
+ * COLLECT and with RANGE_READs kept in flight together, and the whole SRAM
+ * of the first and last board with a single RANGE_READ.
+ *
+ * The simulation runs with the fixed delay that the boards used to wait
+ * after every ACK, without it, with cut-through forwarding instead of
+ * store-and-forward, and once more after switching the chain to a faster
+ * baud rate with a BAUD header. It prints the time each transaction takes.
+ *
+ * Given a number of rounds, it runs the same reads over and over instead,
+ * with cut-through forwarding at the default baud rate, and prints the host
+ * CPU time they take. Run under perf or valgrind, this profiles protocol.c
+ * on the host before it is flashed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chain.h"
+
+#define FAST_BAUD_RATE 1000000
+
+/// Blocks in the whole SRAM
+#define RANGE_BLOCKS (HOST_SRAM_SIZE / 512)
+
+/// Longest a transaction can take before the station gives up
+#define STATION_TIMEOUT_NS (30ULL * 1000000000ULL)
+
+/// Bytes received by the station
+static uint8_t station_rx[BODY_SIZE];
+static uint32_t station_rx_len;
+
+static void station_store(uint8_t byte)
+{
+	if (station_rx_len < BODY_SIZE)
+		station_rx[station_rx_len++] = byte;
+}
+
+/// Fill in the prefix and the CRC of a frame, as the station does
+static void seal_header(header_t *header)
+{
+	header->sync = FRAME_SYNC;
+	header->length = HEADER_SIZE;
+	header->crc = header_crc(header);
+}
+
+static void seal_body(body_t *body)
+{
+	body->sync = FRAME_SYNC;
+	body->length = BODY_SIZE;
+	body->crc = body_crc(body);
+}
+
+/// Run until the station has received a frame of num_bytes
+static uint8_t station_wait(uint32_t num_bytes, uint64_t deadline)
+{
+	while (station_rx_len < num_bytes && now < deadline) {
+		if (!step())
+			return 0;
+	}
+	return station_rx_len >= num_bytes;
+}
+
+/// Run until the station has received a whole frame of either kind
+///
+/// Returns the size of the frame, 0 if none arrived.
+static uint16_t station_frame(uint64_t deadline)
+{
+	uint16_t length;
+
+	station_rx_len = 0;
+	if (!station_wait(FRAME_PREFIX_SIZE, deadline))
+		return 0;
+
+	length = station_rx[2] | (station_rx[3] << 8);
+	if (length > BODY_SIZE || !station_wait(length, deadline))
+		return 0;
+	return length;
+}
+
+static void reset_chain(uint32_t delay_ms, uint16_t chunk_size)
+{
+	chain_reset(delay_ms, chunk_size);
+	station_rx_len = 0;
+}
+
+/// Discover the chain with a PING, as the station does
+static double discover(header_t *acks)
+{
+	header_t ping = { .type = PING };
+	uint64_t start = now;
+
+	seal_header(&ping);
+	link_send(&down[0], now, (uint8_t *)&ping, HEADER_SIZE, station_rate);
+
+	for (int b = 0; b < num_boards; b++) {
+		station_rx_len = 0;
+		if (!station_wait(HEADER_SIZE, start + STATION_TIMEOUT_NS)
+				|| !parse_header(station_rx, &acks[b]) || acks[b].type != ACK) {
+			fprintf(stderr, "board %d did not answer the PING\n", b);
+			exit(1);
+		}
+	}
+	return (double)(now - start) / NS_PER_MS;
+}
+
+/// Read one block from a board, as DeviceManager::read_block does
+static double read_block(int b, const header_t *id, uint16_t address_offset)
+{
+	header_t header = {
+		.type = READ,
+		.bid_high = id->bid_high,
+		.bid_medium = id->bid_medium,
+		.bid_low = id->bid_low,
+	};
+	body_t body = {
+		.type = MEMORY,
+		.bid_high = id->bid_high,
+		.bid_medium = id->bid_medium,
+		.bid_low = id->bid_low,
+		.mem_address = address_offset,
+	};
+	header_t ack;
+	body_t answer;
+	uint64_t start = now;
+
+	seal_header(&header);
+	seal_body(&body);
+
+	// Let the chain settle before starting a new transaction
+	while (step())
+		;
+	start = now;
+
+	station_rx_len = 0;
+	link_send(&down[0], now, (uint8_t *)&header, HEADER_SIZE, station_rate);
+	if (!station_wait(HEADER_SIZE, start + STATION_TIMEOUT_NS)
+			|| !parse_header(station_rx, &ack) || ack.type != ACK) {
+		fprintf(stderr, "board %d did not ACK the READ\n", b);
+		exit(1);
+	}
+
+	// The ACK means the board is ready for the body
+	station_rx_len = 0;
+	link_send(&down[0], now, (uint8_t *)&body, BODY_SIZE, station_rate);
+	if (!station_wait(BODY_SIZE, start + STATION_TIMEOUT_NS)
+			|| !parse_body(station_rx, &answer)
+			|| memcmp(answer.data, boards[b].sram + address_offset * 512, 512) != 0) {
+		fprintf(stderr, "board %d did not answer the body\n", b);
+		exit(1);
+	}
+
+	return (double)(now - start) / NS_PER_MS;
+}
+
+/// Read a range of blocks from a board with a single RANGE_READ
+static double read_range(int b, const header_t *id, uint16_t address_offset,
+		uint16_t num_blocks)
+{
+	header_t header = {
+		.type = RANGE_READ,
+		.bid_high = id->bid_high,
+		.bid_medium = id->bid_medium,
+		.bid_low = id->bid_low,
+		.arg = address_offset | ((uint32_t)num_blocks << 16),
+	};
+	header_t trailer;
+	body_t answer;
+	uint64_t start;
+
+	seal_header(&header);
+
+	while (step())
+		;
+	start = now;
+
+	link_send(&down[0], now, (uint8_t *)&header, HEADER_SIZE, station_rate);
+	for (uint16_t i = 0; i < num_blocks; i++) {
+		station_rx_len = 0;
+		if (!station_wait(BODY_SIZE, start + STATION_TIMEOUT_NS)
+				|| !parse_body(station_rx, &answer)
+				|| answer.mem_address != address_offset + i
+				|| memcmp(answer.data, boards[b].sram + answer.mem_address * 512, 512) != 0) {
+			fprintf(stderr, "board %d did not send block %u of the range\n", b, i);
+			exit(1);
+		}
+	}
+
+	station_rx_len = 0;
+	if (!station_wait(HEADER_SIZE, start + STATION_TIMEOUT_NS)
+			|| !parse_header(station_rx, &trailer) || trailer.type != RANGE_END
+			|| trailer.arg != num_blocks) {
+		fprintf(stderr, "board %d did not end the range\n", b);
+		exit(1);
+	}
+
+	return (double)(now - start) / NS_PER_MS;
+}
+
+/// Read the same block from every board with a single COLLECT
+static double collect(const header_t *acks, uint16_t address_offset)
+{
+	header_t header = {
+		.type = COLLECT,
+		.arg = address_offset | ((uint32_t)num_boards << 16),
+	};
+	body_t answer;
+	uint64_t start;
+
+	seal_header(&header);
+
+	while (step())
+		;
+	start = now;
+
+	link_send(&down[0], now, (uint8_t *)&header, HEADER_SIZE, station_rate);
+	for (int b = 0; b < num_boards; b++) {
+		// Blocks arrive in the order of the boards in the chain
+		station_rx_len = 0;
+		if (!station_wait(BODY_SIZE, start + STATION_TIMEOUT_NS)
+				|| !parse_body(station_rx, &answer)
+				|| answer.bid_low != acks[b].bid_low
+				|| answer.mem_address != address_offset
+				|| memcmp(answer.data, boards[b].sram + address_offset * 512, 512) != 0) {
+			fprintf(stderr, "board %d did not answer the COLLECT\n", b);
+			exit(1);
+		}
+	}
+
+	return (double)(now - start) / NS_PER_MS;
+}
+
+/// Read the same block from every board with a RANGE_READ of one block
+/// each, with up to window of them in flight, as DeviceManager::read_ranges
+/// does. The answers are told apart by their sequence number.
+static double read_pipelined(const header_t *acks, uint16_t address_offset, int window)
+{
+	uint8_t received[MAX_BOARDS] = { 0 };
+	int next = 0;
+	int in_flight = 0;
+	int finished = 0;
+	uint64_t start;
+
+	while (step())
+		;
+	start = now;
+
+	while (finished < num_boards) {
+		header_t trailer;
+		body_t answer;
+		uint16_t length;
+
+		while (next < num_boards && in_flight < window) {
+			header_t header = {
+				.type = RANGE_READ,
+				.seq = next,
+				.bid_high = acks[next].bid_high,
+				.bid_medium = acks[next].bid_medium,
+				.bid_low = acks[next].bid_low,
+				.arg = address_offset | (1 << 16),
+			};
+
+			seal_header(&header);
+			link_send(&down[0], now, (uint8_t *)&header, HEADER_SIZE, station_rate);
+			next++;
+			in_flight++;
+		}
+
+		length = station_frame(start + STATION_TIMEOUT_NS);
+		if (length == BODY_SIZE && parse_body(station_rx, &answer)
+				&& answer.seq < num_boards && !received[answer.seq]
+				&& answer.mem_address == address_offset
+				&& memcmp(answer.data, boards[answer.seq].sram + address_offset * 512,
+						512) == 0) {
+			received[answer.seq] = 1;
+		} else if (length == HEADER_SIZE && parse_header(station_rx, &trailer)
+				&& trailer.type == RANGE_END && trailer.seq < num_boards
+				&& received[trailer.seq]) {
+			finished++;
+			in_flight--;
+		} else {
+			fprintf(stderr, "unexpected frame with %d requests in flight\n", in_flight);
+			exit(1);
+		}
+	}
+
+	return (double)(now - start) / NS_PER_MS;
+}
+
+/// Switch the chain to another baud rate, as DeviceManager::set_baud_rate
+/// does
+static double negotiate(uint32_t rate)
+{
+	header_t proposal = { .type = BAUD, .arg = rate };
+	header_t ack;
+	uint64_t start = now;
+
+	seal_header(&proposal);
+	link_send(&down[0], now, (uint8_t *)&proposal, HEADER_SIZE, station_rate);
+
+	for (int b = 0; b < num_boards; b++) {
+		station_rx_len = 0;
+		if (!station_wait(HEADER_SIZE, start + STATION_TIMEOUT_NS)
+				|| !parse_header(station_rx, &ack) || ack.type != ACK
+				|| ack.arg != rate) {
+			fprintf(stderr, "board %d does not support %u baud\n", b, (unsigned)rate);
+			exit(1);
+		}
+	}
+
+	// Switch once the commit has left the station, every board switches
+	// once it has passed the commit on
+	proposal.arg = rate | BAUD_COMMIT;
+	seal_header(&proposal);
+	link_send(&down[0], now, (uint8_t *)&proposal, HEADER_SIZE, station_rate);
+	while (link_pending(&down[0]))
+		step();
+	station_rate = rate;
+
+	while (step())
+		;
+	return (double)(now - start) / NS_PER_MS;
+}
+
+static void run(uint32_t delay_ms, uint16_t chunk_size, uint32_t rate)
+{
+	header_t acks[MAX_BOARDS];
+	double total = 0;
+
+	reset_chain(delay_ms, chunk_size);
+
+	printf("baud rate %u, handshake delay %u ms, ", (unsigned)rate, (unsigned)delay_ms);
+	if (chunk_size) {
+		printf("cut-through in chunks of %u bytes\n", (unsigned)chunk_size);
+	} else {
+		printf("store-and-forward\n");
+	}
+	if (rate != station_rate) {
+		printf("  switch to %7u baud     %10.1f ms\n", (unsigned)rate, negotiate(rate));
+	}
+	printf("  discovery of %d boards  %10.1f ms\n", num_boards, discover(acks));
+
+	for (int b = 0; b < num_boards; b++) {
+		// ACKs arrive in the order of the boards in the chain
+		double latency = read_block(b, &acks[b], b);
+		printf("  read block, board %2d   %10.1f ms\n", b, latency);
+		total += latency;
+	}
+	printf("  mean block latency      %10.1f ms\n", total / num_boards);
+
+	// The same block of every board, one at a time and in a single pass
+	total = 0;
+	for (int b = 0; b < num_boards; b++) {
+		total += read_block(b, &acks[b], 0);
+	}
+	printf("  block 0, one at a time  %10.1f ms\n", total);
+	printf("  block 0, collective     %10.1f ms\n", collect(acks, 0));
+	printf("  block 0, window %2d      %10.1f ms\n", 1, read_pipelined(acks, 0, 1));
+	printf("  block 0, window %2d      %10.1f ms\n", num_boards,
+			read_pipelined(acks, 0, num_boards));
+
+	// The whole SRAM of the first and the last board
+	printf("  %3d blocks, board %2d   %10.1f ms\n", RANGE_BLOCKS, 0,
+			read_range(0, &acks[0], 0, RANGE_BLOCKS));
+	printf("  %3d blocks, board %2d   %10.1f ms\n", RANGE_BLOCKS, num_boards - 1,
+			read_range(num_boards - 1, &acks[num_boards - 1], 0, RANGE_BLOCKS));
+}
+
+/// Run the reads of every board for a number of rounds and print the CPU
+/// time they take on the host
+static void profile(int rounds)
+{
+	header_t acks[MAX_BOARDS];
+	uint32_t transactions = 0;
+	double simulated = 0;
+	clock_t start;
+	double cpu;
+
+	reset_chain(0, FORWARD_CHUNK_SIZE);
+	discover(acks);
+
+	start = clock();
+	for (int r = 0; r < rounds; r++) {
+		for (int b = 0; b < num_boards; b++) {
+			simulated += read_block(b, &acks[b], r % RANGE_BLOCKS);
+		}
+		simulated += collect(acks, r % RANGE_BLOCKS);
+		simulated += read_pipelined(acks, r % RANGE_BLOCKS, num_boards);
+		simulated += read_range(num_boards - 1, &acks[num_boards - 1], 0, RANGE_BLOCKS);
+		transactions += num_boards + 3;
+	}
+	cpu = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+
+	printf("%d rounds, %u transactions on %d boards\n", rounds, (unsigned)transactions,
+			num_boards);
+	printf("  simulated time          %10.1f ms\n", simulated);
+	printf("  host CPU time           %10.1f ms\n", cpu);
+	printf("  per transaction         %10.3f ms\n", cpu / transactions);
+}
+
+int main(int argc, char **argv)
+{
+	int size = (argc > 1) ? atoi(argv[1]) : 10;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 0;
+
+	if (size < 1 || size > MAX_BOARDS || rounds < 0) {
+		fprintf(stderr, "usage: %s [number of boards, up to %d] [rounds to profile]\n",
+				argv[0], MAX_BOARDS);
+		return 1;
+	}
+
+	chain_init(size);
+	for (int b = 0; b < num_boards; b++) {
+		for (uint32_t i = 0; i < HOST_SRAM_SIZE; i++) {
+			boards[b].sram[i] = (uint8_t)(i * 13 + b);
+		}
+		for (uint32_t i = 0; i < HOST_UID_SIZE; i++) {
+			boards[b].uid[i] = (uint8_t)(i * 0x11 + b);
+		}
+	}
+	station_receive = station_store;
+
+	if (rounds) {
+		profile(rounds);
+		return 0;
+	}
+
+	run(1000, 0, BAUD_RATE);
+	run(0, 0, BAUD_RATE);
+	run(0, FORWARD_CHUNK_SIZE, BAUD_RATE);
+	run(0, FORWARD_CHUNK_SIZE, FAST_BAUD_RATE);
+
+	return 0;
+}
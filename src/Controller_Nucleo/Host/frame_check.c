@@ -0,0 +1,451 @@
+/*
+ * frame_check.c
+ *
+ * Check on the host the frames sent by protocol.c.
+ *
+ * Headers and bodies are sent through the HAL stub, which records the
+ * bytes instead of putting them on the wire. The frames are then parsed
+ * back and compared with what was sent. The parser of the bytes received
+ * is fed partial frames, noise, a frame missing a byte and frames back to
+ * back.
+ *
+ * BAUD headers are fed to the main loop to check the switch of baud rate
+ * and its fallback. A COLLECT header is fed the same way, to check the
+ * block of the board and the header passed on.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "protocol.h"
+
+#define BAUD_RATE 115200
+
+extern UART_HandleTypeDef huart1;
+extern UART_HandleTypeDef huart3;
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+	printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+	failures += !ok;
+}
+
+/// Fill in the prefix and the CRC of a frame, as the station does
+static void seal_header(header_t *header)
+{
+	header->sync = FRAME_SYNC;
+	header->length = HEADER_SIZE;
+	header->crc = header_crc(header);
+}
+
+static void seal_body(body_t *body)
+{
+	body->sync = FRAME_SYNC;
+	body->length = BODY_SIZE;
+	body->crc = body_crc(body);
+}
+
+/// Time to put a frame on the wire, 10 bits per byte
+static double wire_ms(uint32_t num_bytes)
+{
+	return num_bytes * 10 * 1000.0 / BAUD_RATE;
+}
+
+static void report(const char *name, UART_HandleTypeDef *huart)
+{
+	printf("%-8s %4u bytes in %u transfer(s), %.2f ms on the wire\n", name,
+			(unsigned)huart->tx_len, (unsigned)huart->num_transfers,
+			wire_ms(huart->tx_len));
+}
+
+static void check_header(void)
+{
+	header_t sent = {
+		.type = READ,
+		.ttl = 3,
+		.bid_high = get_bid_high(),
+		.bid_medium = get_bid_medium(),
+		.bid_low = get_bid_low(),
+	};
+	header_t received;
+
+	host_uart_reset(&huart3);
+	transmit_header(&huart3, &sent);
+	report("header", &huart3);
+
+	check(huart3.tx_len == HEADER_SIZE, "header has HEADER_SIZE bytes");
+	check(huart3.num_transfers == 1, "header is sent with one transfer");
+	check(parse_header(huart3.tx_log, &received), "header CRC matches");
+	check(memcmp(&sent, &received, HEADER_SIZE) == 0, "header fields survive");
+
+	huart3.tx_log[5] ^= 0x01;
+	check(!parse_header(huart3.tx_log, &received), "corrupted header is rejected");
+}
+
+static void check_memory_body(void)
+{
+	body_t sent = {
+		.type = MEMORY,
+		.bid_high = get_bid_high(),
+		.bid_medium = get_bid_medium(),
+		.bid_low = get_bid_low(),
+		.mem_address = 7,
+	};
+	body_t received;
+
+	host_uart_reset(&huart1);
+	transmit_body(&huart1, &sent);
+	report("body", &huart1);
+
+	check(huart1.tx_len == BODY_SIZE, "body has BODY_SIZE bytes");
+	check(huart1.num_transfers == 1, "body is sent with one transfer");
+	check(parse_body(huart1.tx_log, &received), "body CRC matches");
+	check(received.mem_address == sent.mem_address, "body address survives");
+	check(memcmp(received.data, host_sram + 7 * 512, 512) == 0,
+			"body data is the SRAM region");
+
+	huart1.tx_log[BODY_SIZE - 1] ^= 0x80;
+	check(!parse_body(huart1.tx_log, &received), "corrupted body is rejected");
+}
+
+static void check_forward(void)
+{
+	uint8_t frame[BODY_SIZE];
+
+	for (int i = 0; i < BODY_SIZE; i++) {
+		frame[i] = (uint8_t)(i * 31);
+	}
+
+	host_uart_reset(&huart1);
+	transmit_buffer(frame, BODY_SIZE);
+	report("forward", &huart1);
+
+	check(huart1.num_transfers == 1, "forwarded frame is sent with one transfer");
+	check(huart1.tx_len == BODY_SIZE
+			&& memcmp(huart1.tx_log, frame, BODY_SIZE) == 0,
+			"forwarded frame is unchanged");
+}
+
+/// Receive a header from up the chain and let the main loop handle it
+static void receive_header(header_t *header)
+{
+	seal_header(header);
+	for (int i = 0; i < HEADER_SIZE; i++) {
+		receive_byte(&huart1, ((uint8_t *)header)[i]);
+	}
+	protocol_poll();
+	protocol_poll();
+}
+
+static void check_baud(void)
+{
+	header_t proposal = { .type = BAUD, .arg = 1000000 };
+	header_t ack;
+
+	init_configuration();
+
+	host_uart_reset(&huart1);
+	host_uart_reset(&huart3);
+	receive_header(&proposal);
+	check(parse_header(huart1.tx_log, &ack) && ack.type == ACK
+			&& ack.arg == 1000000, "1 Mbaud is supported");
+	check(huart3.tx_len == HEADER_SIZE, "proposal is passed on");
+
+	proposal.arg = 2000000;
+	host_uart_reset(&huart1);
+	receive_header(&proposal);
+	check(parse_header(huart1.tx_log, &ack) && ack.arg == 0,
+			"2 Mbaud is not supported");
+
+	proposal.arg = 1000000 | BAUD_COMMIT;
+	host_uart_reset(&huart3);
+	receive_header(&proposal);
+	check(huart3.tx_len == HEADER_SIZE, "commit is passed on");
+	check(huart1.Init.BaudRate == 1000000 && huart3.Init.BaudRate == 1000000,
+			"commit switches both USARTs");
+
+	host_tick += 2 * BAUD_CONFIRM_MS;
+	protocol_poll();
+	check(huart1.Init.BaudRate == BAUD_RATE && huart3.Init.BaudRate == BAUD_RATE,
+			"unconfirmed rate falls back");
+
+	receive_header(&proposal);
+	proposal = (header_t){ .type = PING, .bid_high = 1 };
+	receive_header(&proposal);
+	host_tick += 2 * BAUD_CONFIRM_MS;
+	protocol_poll();
+	check(huart1.Init.BaudRate == 1000000, "confirmed rate is kept");
+}
+
+static void check_digest(void)
+{
+	header_t request = {
+		.type = DIGEST,
+		.seq = 7,
+		.bid_high = get_bid_high(),
+		.bid_medium = get_bid_medium(),
+		.bid_low = get_bid_low(),
+		.arg = 3 | (4 << 16),
+	};
+	header_t ack;
+	uint32_t digest = DIGEST_INIT;
+
+	for (uint32_t i = 3 * 512; i < 7 * 512; i++) {
+		digest = (digest ^ host_sram[i]) * DIGEST_PRIME;
+	}
+
+	host_uart_reset(&huart1);
+	host_uart_reset(&huart3);
+	receive_header(&request);
+	report("digest", &huart1);
+
+	check(parse_header(huart1.tx_log, &ack) && ack.type == ACK
+			&& ack.arg == digest, "digest of the region is in the ACK");
+	check(ack.seq == 7, "ACK carries the sequence number of the request");
+	check(huart3.tx_len == 0, "digest is not passed on by the target");
+
+	request.arg = (SRAM_NUM_BLOCKS - 3) | (4 << 16);
+	host_uart_reset(&huart1);
+	receive_header(&request);
+	check(parse_header(huart1.tx_log, &ack) && ack.type == RANGE_END
+			&& ack.arg == 0 && ack.seq == 7,
+			"digest past the end of SRAM is refused");
+}
+
+static void push_bytes(rx_stream_t *rx, const void *bytes, uint16_t num_bytes)
+{
+	for (uint16_t i = 0; i < num_bytes; i++) {
+		rx_push(rx, ((const uint8_t *)bytes)[i]);
+	}
+}
+
+static void check_parser(void)
+{
+	static rx_stream_t rx;
+	header_t sent = { .type = PING, .ttl = 2 };
+	body_t body = { .type = MEMORY, .mem_address = 3 };
+	// A preamble and a size which do not match the type
+	uint8_t noise[] = { 0x00, 0xA5, 0x5A, HEADER_SIZE, 0x00, MEMORY, 0x42 };
+	uint8_t whole = 1, in_order = 1;
+	header_t received;
+	body_t corrupted;
+
+	seal_header(&sent);
+	seal_body(&body);
+
+	// Half a body is not a frame yet
+	push_bytes(&rx, &body, BODY_SIZE / 2);
+	check(!rx_parse(&rx) && rx.expected == BODY_SIZE, "partial body is kept until complete");
+	push_bytes(&rx, (uint8_t *)&body + BODY_SIZE / 2, BODY_SIZE - BODY_SIZE / 2);
+	check(rx_parse(&rx) && memcmp(rx.frame, &body, BODY_SIZE) == 0,
+			"body is complete once its last byte arrives");
+	rx_release(&rx);
+
+	// Bytes that cannot start a frame are skipped
+	push_bytes(&rx, noise, sizeof(noise));
+	push_bytes(&rx, &sent, HEADER_SIZE);
+	check(rx_parse(&rx) && parse_header(rx.frame, &received)
+			&& received.ttl == sent.ttl, "noise before a header is skipped");
+	rx_release(&rx);
+
+	// A byte lost inside a body, which then ends with the next header
+	push_bytes(&rx, &body, 100);
+	push_bytes(&rx, (uint8_t *)&body + 101, BODY_SIZE - 101);
+	push_bytes(&rx, &sent, HEADER_SIZE);
+	push_bytes(&rx, &sent, HEADER_SIZE);
+	check(rx_parse(&rx) && !parse_body(rx.frame, &corrupted), "body missing a byte is rejected");
+	rx_reject(&rx);
+	check(rx_parse(&rx) && parse_header(rx.frame, &received), "header after it is found again");
+	rx_release(&rx);
+	check(rx_parse(&rx) && parse_header(rx.frame, &received), "next header is not affected");
+	rx_release(&rx);
+
+	// Frames back to back, going around the ring several times
+	for (int round = 0; round < 8; round++) {
+		push_bytes(&rx, &sent, HEADER_SIZE);
+		push_bytes(&rx, &body, BODY_SIZE);
+		push_bytes(&rx, &sent, HEADER_SIZE);
+
+		whole &= rx_parse(&rx) && rx.expected == HEADER_SIZE;
+		in_order &= memcmp(rx.frame, &sent, HEADER_SIZE) == 0;
+		rx_release(&rx);
+		whole &= rx_parse(&rx) && rx.expected == BODY_SIZE;
+		in_order &= memcmp(rx.frame, &body, BODY_SIZE) == 0;
+		rx_release(&rx);
+		whole &= rx_parse(&rx) && rx.expected == HEADER_SIZE;
+		in_order &= memcmp(rx.frame, &sent, HEADER_SIZE) == 0;
+		rx_release(&rx);
+	}
+	check(whole && !rx_parse(&rx), "frames back to back are all parsed");
+	check(in_order && rx.dropped == 0, "no byte is lost around the ring");
+
+	// A full ring drops the bytes that do not fit
+	for (int i = 0; i < RX_RING_SIZE; i++) {
+		rx_push(&rx, PING);
+	}
+	check(rx.dropped == 1, "full ring drops the extra byte");
+
+	rx_flush(&rx);
+	check(!rx_parse(&rx) && rx.num_bytes == 0, "flushed ring holds no frame");
+}
+
+static void check_collect(void)
+{
+	header_t request = {
+		.type = COLLECT,
+		.seq = 9,
+		.arg = 5 | (3 << 16),
+	};
+	header_t passed;
+	body_t answer;
+
+	host_uart_reset(&huart1);
+	host_uart_reset(&huart3);
+	receive_header(&request);
+	report("collect", &huart1);
+
+	check(parse_body(huart1.tx_log, &answer) && answer.mem_address == 5
+			&& answer.bid_low == get_bid_low()
+			&& memcmp(answer.data, host_sram + 5 * 512, 512) == 0,
+			"own block is sent up for a COLLECT");
+	check(answer.seq == 9, "block carries the sequence number of the request");
+	check(parse_header(huart3.tx_log, &passed) && passed.type == COLLECT
+			&& passed.ttl == 1 && passed.arg == request.arg,
+			"COLLECT is passed on to the next board");
+}
+
+/// A block past the end of SRAM is refused with a NACK instead of being
+/// read, and the COLLECT still goes on to the boards below
+static void check_collect_bounds(void)
+{
+	header_t request = {
+		.type = COLLECT,
+		.seq = 4,
+		.arg = SRAM_NUM_BLOCKS | (3 << 16),
+	};
+	header_t nack, passed;
+
+	host_uart_reset(&huart1);
+	host_uart_reset(&huart3);
+	receive_header(&request);
+
+	check(huart1.tx_len == HEADER_SIZE && parse_header(huart1.tx_log, &nack)
+			&& nack.type == NACK && nack.seq == 4
+			&& nack.bid_low == get_bid_low(),
+			"block past SRAM is refused with a NACK");
+	check(parse_header(huart3.tx_log, &passed) && passed.type == COLLECT
+			&& passed.ttl == 1,
+			"refused COLLECT is passed on to the next board");
+}
+
+static void poll_range(void)
+{
+	for (int i = 0; i < 8; i++) {
+		protocol_poll();
+	}
+}
+
+/// A range read ends at the last block of SRAM, past it only the trailer
+/// is sent
+static void check_range_bounds(void)
+{
+	header_t request = {
+		.type = RANGE_READ,
+		.seq = 5,
+		.bid_high = get_bid_high(),
+		.bid_medium = get_bid_medium(),
+		.bid_low = get_bid_low(),
+		.arg = (SRAM_NUM_BLOCKS - 1) | (1 << 16),
+	};
+	header_t trailer;
+	body_t block;
+
+	check(HOST_SRAM_SIZE == SRAM_NUM_BLOCKS * 512, "SRAM_NUM_BLOCKS matches the SRAM");
+
+	host_uart_reset(&huart1);
+	host_uart_reset(&huart3);
+	receive_header(&request);
+	poll_range();
+	check(huart1.tx_len == BODY_SIZE + HEADER_SIZE
+			&& parse_body(huart1.tx_log, &block)
+			&& block.mem_address == SRAM_NUM_BLOCKS - 1
+			&& parse_header(huart1.tx_log + BODY_SIZE, &trailer)
+			&& trailer.type == RANGE_END && trailer.arg == 1,
+			"last block of SRAM is sent");
+
+	request.arg = (SRAM_NUM_BLOCKS - 1) | (2 << 16);
+	host_uart_reset(&huart1);
+	receive_header(&request);
+	poll_range();
+	check(huart1.tx_len == HEADER_SIZE
+			&& parse_header(huart1.tx_log, &trailer)
+			&& trailer.type == RANGE_END && trailer.arg == 0
+			&& trailer.seq == 5,
+			"range past the end of SRAM gets an empty trailer");
+}
+
+/// A frame of the board must not cut into one being passed up the chain
+static void check_up_link(void)
+{
+	header_t ping = {
+		.type = PING,
+		.seq = 3,
+		.bid_high = get_bid_high(),
+		.bid_medium = get_bid_medium(),
+		.bid_low = get_bid_low(),
+	};
+	body_t passed = { .type = MEMORY, .seq = 4, .mem_address = 1 };
+	header_t ack;
+
+	memset(passed.data, 0x3C, sizeof(passed.data));
+	seal_body(&passed);
+
+	host_uart_reset(&huart1);
+	host_uart_reset(&huart3);
+	for (int i = 0; i < BODY_SIZE / 2; i++) {
+		receive_byte(&huart3, ((uint8_t *)&passed)[i]);
+		protocol_poll();
+	}
+	check(huart1.tx_len > 0 && huart1.tx_len < BODY_SIZE,
+			"half of the frame from below is already passed up");
+
+	receive_header(&ping);
+	check(huart1.tx_len < BODY_SIZE, "ACK waits for the frame being passed up");
+
+	for (int i = BODY_SIZE / 2; i < BODY_SIZE; i++) {
+		receive_byte(&huart3, ((uint8_t *)&passed)[i]);
+		protocol_poll();
+	}
+	protocol_poll();
+	protocol_poll();
+	check(huart1.tx_len == BODY_SIZE + HEADER_SIZE
+			&& memcmp(huart1.tx_log, &passed, BODY_SIZE) == 0
+			&& parse_header(huart1.tx_log + BODY_SIZE, &ack)
+			&& ack.type == ACK && ack.seq == 3,
+			"ACK follows the whole frame from below");
+}
+
+int main(void)
+{
+	for (uint32_t i = 0; i < HOST_SRAM_SIZE; i++) {
+		host_sram[i] = (uint8_t)(i * 7 + (i >> 8));
+	}
+	for (uint32_t i = 0; i < HOST_UID_SIZE; i++) {
+		host_uid[i] = (uint8_t)(0xA0 + i);
+	}
+
+	check_header();
+	check_memory_body();
+	check_forward();
+	check_parser();
+	check_baud();
+	check_digest();
+	check_collect();
+	check_collect_bounds();
+	check_range_bounds();
+	check_up_link();
+
+	return failures ? 1 : 0;
+}
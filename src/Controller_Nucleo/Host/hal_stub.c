@@ -0,0 +1,128 @@
+/*
+ * hal_stub.c
+ *
+ * Host implementation of the HAL functions used by protocol.c.
+ */
+
+#include <string.h>
+
+#include "stm32l1xx_hal.h"
+
+BOARD_STATE UART_HandleTypeDef huart1 = {
+	.Init = { .BaudRate = 115200 },
+	.gState = HAL_UART_STATE_READY,
+	.RxState = HAL_UART_STATE_READY,
+};
+BOARD_STATE UART_HandleTypeDef huart3 = {
+	.Init = { .BaudRate = 115200 },
+	.gState = HAL_UART_STATE_READY,
+	.RxState = HAL_UART_STATE_READY,
+};
+
+static uint8_t default_sram[HOST_SRAM_SIZE];
+static uint8_t default_uid[HOST_UID_SIZE];
+
+BOARD_STATE uint8_t *host_sram = default_sram;
+BOARD_STATE uint8_t *host_uid = default_uid;
+
+void (*host_uart_tx)(UART_HandleTypeDef *huart, const uint8_t *data, uint16_t size) = NULL;
+void (*host_delay)(uint32_t ms) = NULL;
+void (*host_tick_read)(void) = NULL;
+uint32_t host_tick = 0;
+
+static HAL_StatusTypeDef record(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart->gState != HAL_UART_STATE_READY)
+		return HAL_BUSY;
+
+	if (host_uart_tx) {
+		host_uart_tx(huart, pData, Size);
+		return HAL_OK;
+	}
+
+	if (huart->tx_len + Size > HOST_TX_LOG_SIZE)
+		return HAL_ERROR;
+
+	memcpy(huart->tx_log + huart->tx_len, pData, Size);
+	huart->tx_len += Size;
+	huart->num_transfers++;
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	huart->gState = HAL_UART_STATE_READY;
+	huart->RxState = HAL_UART_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	(void)Timeout;
+	return record(huart, pData, Size);
+}
+
+/// The transfer completes at once, as if the DMA was infinitely fast
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	return record(huart, pData, Size);
+}
+
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart)
+{
+	huart->gState = HAL_UART_STATE_READY;
+	return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+	return HOST_PCLK_FREQ;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+	return HOST_PCLK_FREQ;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	if (host_tick_read)
+		host_tick_read();
+
+	// Nothing else advances the tick while the firmware waits in a loop
+	return host_delay ? host_tick : host_tick++;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	if (host_delay)
+		host_delay(Delay);
+	else
+		host_tick += Delay;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint32_t Data)
+{
+	(void)TypeProgram;
+	(void)Address;
+	(void)Data;
+	return HAL_OK;
+}
+
+void host_uart_reset(UART_HandleTypeDef *huart)
+{
+	huart->tx_len = 0;
+	huart->num_transfers = 0;
+	huart->gState = HAL_UART_STATE_READY;
+}
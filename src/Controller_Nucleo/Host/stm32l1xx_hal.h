@@ -0,0 +1,105 @@
+/*
+ * stm32l1xx_hal.h
+ *
+ * Minimal stand-in for the STM32L1 HAL, used to build protocol.c on the
+ * host. Transmitted frames are recorded in the UART handle, or handed to
+ * host_uart_tx if it is set, and SRAM and the unique ID live in host
+ * arrays.
+ *
+ * The state of a board is kept in the board_state section, so that a
+ * simulation can run several boards by swapping the contents of the
+ * section.
+ */
+
+#ifndef HOST_STM32L1XX_HAL_H_
+#define HOST_STM32L1XX_HAL_H_
+
+#include <stdint.h>
+
+#define BOARD_STATE __attribute__((section("board_state")))
+
+/// SRAM of the STM32L152RE
+#define HOST_SRAM_SIZE (80 * 1024)
+#define HOST_UID_SIZE 0x20
+#define HOST_TX_LOG_SIZE 1024
+
+/// APB1 and APB2 clocks of the board, 24 MHz from the PLL
+#define HOST_PCLK_FREQ 24000000U
+
+/// Memory of the board, which a simulation can point to its own arrays
+extern uint8_t *host_sram;
+extern uint8_t *host_uid;
+
+#define SRAM_BASE ((uintptr_t)host_sram)
+#define UID_BASE ((uintptr_t)host_uid)
+
+typedef enum {
+	HAL_OK = 0x00U,
+	HAL_ERROR = 0x01U,
+	HAL_BUSY = 0x02U,
+	HAL_TIMEOUT = 0x03U,
+} HAL_StatusTypeDef;
+
+typedef enum {
+	HAL_UART_STATE_RESET = 0x00U,
+	HAL_UART_STATE_READY = 0x20U,
+	HAL_UART_STATE_BUSY_TX = 0x21U,
+	HAL_UART_STATE_BUSY_RX = 0x22U,
+} HAL_UART_StateTypeDef;
+
+typedef struct {
+	uint32_t BaudRate;
+} UART_InitTypeDef;
+
+typedef struct {
+	void *Instance;
+	UART_InitTypeDef Init;
+	volatile HAL_UART_StateTypeDef gState;
+	volatile HAL_UART_StateTypeDef RxState;
+
+	/// Bytes sent through the USART and number of transfers started
+	uint8_t tx_log[HOST_TX_LOG_SIZE];
+	uint32_t tx_len;
+	uint32_t num_transfers;
+} UART_HandleTypeDef;
+
+#define FLASH_TYPEPROGRAM_WORD 0x02U
+
+/// Bytes are handed to receive_byte by the host, as the RXNE interrupt of
+/// the board does
+#define UART_IT_RXNE 0x20U
+#define __HAL_UART_ENABLE_IT(huart, it) ((void)(huart), (void)(it))
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_AbortTransmit(UART_HandleTypeDef *huart);
+
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint32_t Data);
+
+/// Forget the frames recorded in a UART handle
+void host_uart_reset(UART_HandleTypeDef *huart);
+
+/// When set, transmitted frames are handed to it instead of being recorded
+extern void (*host_uart_tx)(UART_HandleTypeDef *huart, const uint8_t *data, uint16_t size);
+
+/// When set, HAL_Delay calls it instead of advancing the tick
+extern void (*host_delay)(uint32_t ms);
+
+/// Value returned by HAL_GetTick
+extern uint32_t host_tick;
+
+/// When set, HAL_GetTick calls it first. The firmware reads the tick while
+/// it waits for a USART, so a simulation can move time on to when the
+/// USART is done.
+extern void (*host_tick_read)(void);
+
+#endif /* HOST_STM32L1XX_HAL_H_ */
@@ -0,0 +1,68 @@
+/**
+ * @file crc_benchmark.cpp
+ *
+ * @brief Throughput of the CRC-16 used to protect every packet.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#include <cstdlib>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "include/packet.hpp"
+
+/// CRC of raw buffers, from one body up to a whole SRAM dump
+static void
+BM_compute_crc (benchmark::State &state)
+{
+  std::vector<uint8_t> buf (state.range (0));
+  for (auto &byte : buf)
+    byte = std::rand ();
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (compute_crc (buf.data (), buf.size ()));
+    }
+  state.SetBytesProcessed (state.iterations () * buf.size ());
+}
+BENCHMARK (BM_compute_crc)->RangeMultiplier (4)->Range (16, 80 * 1024);
+
+/// CRC of a header, done once per header sent or received
+static void
+BM_header_crc (benchmark::State &state)
+{
+  header_t header = { .type = (uint8_t)header_type::READ,
+                      .TTL = 0,
+                      .CRC = 0,
+                      .bid_high = 0x00420031,
+                      .bid_medium = 0x3436510D,
+                      .bid_low = 0x30373538 };
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (header_crc (header));
+    }
+  state.SetBytesProcessed (state.iterations () * sizeof (header_t));
+}
+BENCHMARK (BM_header_crc);
+
+/// CRC of a body, done once per block of memory read or written
+static void
+BM_body_crc (benchmark::State &state)
+{
+  body_t body = {};
+  body.type = (uint8_t)body_type::MEMORY;
+  for (auto &byte : body.data)
+    byte = std::rand ();
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (body_crc (body));
+    }
+  state.SetBytesProcessed (state.iterations () * sizeof (body_t));
+}
+BENCHMARK (BM_body_crc);
+
+BENCHMARK_MAIN ();
@@ -0,0 +1,71 @@
+/**
+ * @file db_benchmark.cpp
+ *
+ * @brief Cost of turning blocks into documents and back, without a
+ * database.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "include/db_manager.hpp"
+
+/// Document of a block of memory, once per block stored
+static void
+BM_body_to_doc (benchmark::State &state)
+{
+  body_t body = {};
+  body.type = (uint8_t)body_type::MEMORY;
+  for (auto &byte : body.data)
+    byte = std::rand ();
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (DBManager::body_to_doc (body).extract ());
+    }
+  state.SetBytesProcessed (state.iterations () * PAYLOAD_SIZE);
+}
+BENCHMARK (BM_body_to_doc);
+
+/// Data of a reference stored by older versions of the station
+static void
+BM_parse_data_string (benchmark::State &state)
+{
+  std::string data_str;
+  for (int byte = 0; byte < PAYLOAD_SIZE; ++byte)
+    data_str += std::to_string (std::rand () & 0xFF) + ",";
+  data_str.pop_back ();
+
+  for (auto _ : state)
+    {
+      std::vector<uint8_t> values;
+      values.reserve (PAYLOAD_SIZE);
+      parse_data_string (data_str, values);
+      benchmark::DoNotOptimize (values.data ());
+    }
+  state.SetBytesProcessed (state.iterations () * data_str.size ());
+}
+BENCHMARK (BM_parse_data_string);
+
+/// Inverted reference of a block, written by write_invert
+static void
+BM_invert_bytes_arr (benchmark::State &state)
+{
+  std::vector<uint8_t> bytes (state.range (0));
+  for (auto &byte : bytes)
+    byte = std::rand ();
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (invert_bytes_arr (bytes));
+    }
+  state.SetBytesProcessed (state.iterations () * bytes.size ());
+}
+BENCHMARK (BM_invert_bytes_arr)->Arg (PAYLOAD_SIZE)->Arg (80 * 1024);
+
+BENCHMARK_MAIN ();
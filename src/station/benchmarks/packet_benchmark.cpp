@@ -0,0 +1,157 @@
+/**
+ * @file packet_benchmark.cpp
+ *
+ * @brief Cost of sealing, finding and checking the frames of a chain, and
+ * of the hex strings used as device IDs.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "include/packet.hpp"
+
+/// Header of a READ for a device, as built by the endpoints
+static header_t
+read_header ()
+{
+  header_t header = {};
+  header.type = (uint8_t)header_type::READ;
+  header.bid_high = 0x00420031;
+  header.bid_medium = 0x3436510D;
+  header.bid_low = 0x30373538;
+  return header;
+}
+
+/// Body of a block of memory as sent by a device
+static body_t
+memory_body ()
+{
+  body_t body = {};
+  body.type = (uint8_t)body_type::MEMORY;
+  body.bid_high = 0x00420031;
+  body.bid_medium = 0x3436510D;
+  body.bid_low = 0x30373538;
+  for (auto &byte : body.data)
+    byte = std::rand ();
+  body.CRC = body_crc (body);
+  return body;
+}
+
+/// Fill the fields of a header before it is sent, as send_header does
+static void
+BM_seal_header (benchmark::State &state)
+{
+  header_t header = read_header ();
+
+  for (auto _ : state)
+    {
+      header.sync = FRAME_SYNC;
+      header.length = sizeof (header_t);
+      header.CRC = header_crc (header);
+      benchmark::DoNotOptimize (header);
+    }
+  state.SetBytesProcessed (state.iterations () * sizeof (header_t));
+}
+BENCHMARK (BM_seal_header);
+
+/// Fill the fields of a body before it is sent, as send_body does
+static void
+BM_seal_body (benchmark::State &state)
+{
+  body_t body = memory_body ();
+
+  for (auto _ : state)
+    {
+      body.sync = FRAME_SYNC;
+      body.length = sizeof (body_t);
+      body.CRC = body_crc (body);
+      benchmark::DoNotOptimize (body);
+    }
+  state.SetBytesProcessed (state.iterations () * sizeof (body_t));
+}
+BENCHMARK (BM_seal_body);
+
+/// Find, check and copy out every body in the bytes read from a chain, as
+/// the reader of a chain does for a range read
+static void
+BM_parse_bodies (benchmark::State &state)
+{
+  body_t body = memory_body ();
+  std::vector<uint8_t> buf (state.range (0) * sizeof (body_t));
+  for (size_t offset = 0; offset < buf.size (); offset += sizeof (body_t))
+    std::memcpy (buf.data () + offset, &body, sizeof (body_t));
+
+  for (auto _ : state)
+    {
+      size_t from = 0;
+      while ((from = frame_start (buf.data (), buf.size (), 0, from))
+             < buf.size ())
+        {
+          size_t len = frame_length (buf.data () + from);
+          if (frame_intact (buf.data () + from, len))
+            {
+              body_t parsed;
+              std::memcpy (&parsed, buf.data () + from, len);
+              benchmark::DoNotOptimize (parsed);
+            }
+          from += len;
+        }
+    }
+  state.SetBytesProcessed (state.iterations () * buf.size ());
+}
+BENCHMARK (BM_parse_bodies)->Arg (1)->Arg (16)->Arg (160);
+
+/// Scan garbage for the start of a frame, as after a lost byte
+static void
+BM_frame_start_garbage (benchmark::State &state)
+{
+  std::vector<uint8_t> buf (state.range (0));
+  for (auto &byte : buf)
+    byte = std::rand () & 0x7F;
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (
+          frame_start (buf.data (), buf.size (), 0, 0));
+    }
+  state.SetBytesProcessed (state.iterations () * buf.size ());
+}
+BENCHMARK (BM_frame_start_garbage)->Arg (sizeof (body_t));
+
+/// Format the ID of a device, once per block stored
+static void
+BM_format_board_id (benchmark::State &state)
+{
+  header_t header = read_header ();
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (format_board_id (
+          header.bid_high, header.bid_medium, header.bid_low));
+    }
+}
+BENCHMARK (BM_format_board_id);
+
+/// Parse the ID of a device, once per request naming a device
+static void
+BM_parse_board_id (benchmark::State &state)
+{
+  std::string board_id = "0x004200313436510D30373538";
+  uint32_t high, medium, low;
+
+  for (auto _ : state)
+    {
+      parse_board_id (board_id, high, medium, low);
+      benchmark::DoNotOptimize (high);
+      benchmark::DoNotOptimize (medium);
+      benchmark::DoNotOptimize (low);
+    }
+}
+BENCHMARK (BM_parse_board_id);
+
+BENCHMARK_MAIN ();
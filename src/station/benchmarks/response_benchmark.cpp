@@ -0,0 +1,89 @@
+/**
+ * @file response_benchmark.cpp
+ *
+ * @brief Cost of building the responses of the station.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#include <cstdlib>
+#include <sstream>
+
+#include <benchmark/benchmark.h>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "include/packet.hpp"
+#include "include/response.hpp"
+
+namespace bpt = boost::property_tree;
+
+/// Response of a memory read in every format, once per block read
+static void
+BM_read_response (benchmark::State &state)
+{
+  auto format = (response_format)state.range (0);
+  body_t body = {};
+  for (auto &byte : body.data)
+    byte = std::rand ();
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (read_response (
+          format, "0x004200313436510D30373538", "0x00000000", body));
+    }
+  state.SetBytesProcessed (state.iterations () * PAYLOAD_SIZE);
+}
+BENCHMARK (BM_read_response)
+    ->Arg ((int)response_format::PRETTY_JSON)
+    ->Arg ((int)response_format::COMPACT_JSON)
+    ->Arg ((int)response_format::BINARY);
+
+/// Encoding of the data of a block for the compact JSON
+static void
+BM_encode_base64 (benchmark::State &state)
+{
+  std::vector<uint8_t> buf (state.range (0));
+  for (auto &byte : buf)
+    byte = std::rand ();
+
+  for (auto _ : state)
+    {
+      benchmark::DoNotOptimize (encode_base64 (buf.data (), buf.size ()));
+    }
+  state.SetBytesProcessed (state.iterations () * buf.size ());
+}
+BENCHMARK (BM_encode_base64)->Arg (PAYLOAD_SIZE)->Arg (80 * 1024);
+
+/// Response with one entry per device of a chain, built as the dump_chain
+/// endpoint builds it
+static void
+BM_dump_chain_response (benchmark::State &state)
+{
+  for (auto _ : state)
+    {
+      bpt::ptree msg, devices_pt;
+      std::stringstream msg_ss;
+
+      for (int dev = 0; dev < state.range (0); ++dev)
+        {
+          bpt::ptree device_pt;
+          device_pt.put ("board_id", format_board_id (0x00420031, 0x3436510D,
+                                                      0x30373500 + dev));
+          device_pt.put ("status", "OK");
+          devices_pt.push_back (bpt::ptree::value_type ("", device_pt));
+        }
+      msg.put ("port_name", "ttyUSB0");
+      msg.put ("mem_address", "0x00000000");
+      msg.put ("num_blocks", 16);
+      msg.put ("references", 0);
+      msg.put ("samples", 16 * state.range (0));
+      msg.add_child ("devices", devices_pt);
+      msg.put ("message", "region of memory dumped from every device");
+
+      bpt::json_parser::write_json (msg_ss, msg, true);
+      benchmark::DoNotOptimize (msg_ss.str ());
+    }
+}
+BENCHMARK (BM_dump_chain_response)->Arg (10)->Arg (32);
+
+BENCHMARK_MAIN ();
@@ -125,23 +125,22 @@ def read_memory():
         device_list = DeviceMap["ports"][port_name]
         for dev in device_list:
             # Memory map for 80kB: 0x20000000 - 0x20014000
-            # We need to use the offset from the start of the memory
-            for address in range(0x0000, 0x14000, 512):
-                msg = f'READ [0x{address:08x}] BOARD [{dev["board_id"]}]'
-                msg = f"{msg}\n[{timestamp()}]"
-                bot.send_message(CHAT_ID, msg)
-                res = requests.post(
-                    f"{STATION}/commands/read",
-                    data=json.dumps(
-                        {
-                            "board_id": dev["board_id"],
-                            "mem_address": address,
-                            "port_name": port_name,
-                        }
-                    ),
-                    headers={"content-type": "application/json"},
-                )
-                time.sleep(CMD_WAIT)
+            # The whole memory is dumped by the station in one transaction
+            msg = f'DUMP [0x00000000 - 0x00014000] BOARD [{dev["board_id"]}]'
+            msg = f"{msg}\n[{timestamp()}]"
+            bot.send_message(CHAT_ID, msg)
+            res = requests.post(
+                f"{STATION}/commands/dump",
+                data=json.dumps(
+                    {
+                        "board_id": dev["board_id"],
+                        "address_offset": 0,
+                        "num_blocks": 0x14000 // 512,
+                    }
+                ),
+                headers={"content-type": "application/json"},
+            )
+            time.sleep(CMD_WAIT)
 
 
 def write_memory():
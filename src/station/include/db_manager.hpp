@@ -12,17 +12,27 @@
 #pragma once
 
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <fmt/core.h>
 
-#include <boost/optional.hpp>
 #include <bsoncxx/builder/stream/array.hpp>
 #include <bsoncxx/builder/stream/document.hpp>
 #include <bsoncxx/builder/stream/helpers.hpp>
 #include <bsoncxx/json.hpp>
+#include <bsoncxx/types.hpp>
 #include <mongocxx/client.hpp>
 #include <mongocxx/instance.hpp>
+#include <mongocxx/options/find.hpp>
+#include <mongocxx/options/insert.hpp>
 #include <mongocxx/stdx.hpp>
 #include <mongocxx/uri.hpp>
 
@@ -30,10 +40,18 @@ using namespace bsoncxx;
 using namespace bsoncxx::document;
 using bson_doc = bsoncxx::builder::basic::document;
 using bson_value = bsoncxx::document::value;
-using MaybeResult = boost::optional<mongocxx::result::insert_one>;
 
 #include "include/packet.hpp"
 
+/** Number of queued documents that triggers a flush of the writer */
+#define WRITE_BATCH_SIZE 256
+
+/** Maximum time a document waits in the queue before being flushed */
+#define WRITE_FLUSH_MS 250
+
+/** Maximum number of documents queued or being written */
+#define WRITE_MAX_PENDING 8192
+
 /**
  * @class DBManager
  */
@@ -50,6 +68,11 @@ private:
    */
   mongocxx::uri client_uri;
 
+  /**
+   * Name of the database storing the samples.
+   */
+  std::string db_name;
+
   /**
    *
    */
@@ -60,6 +83,119 @@ private:
    */
   mongocxx::database db;
 
+  /**
+   * Index of the reference samples stored in the database.
+   *
+   * Holds one key per board and memory address with a reference, so that
+   * classifying a sample does not need a query.
+   *
+   * @see reference_key
+   */
+  std::unordered_set<std::string> references;
+
+  /**
+   * Protects the index of references, shared between the server threads.
+   *
+   * Looking up a reference takes it shared, registering or dropping one
+   * takes it exclusively.
+   */
+  std::shared_mutex references_lock;
+
+  /**
+   * @brief Build the key of a reference sample in the index.
+   *
+   * Both the board id and the memory address have a fixed width, so
+   * concatenating them is unambiguous.
+   *
+   * @param board_id Hex string with the board id.
+   * @param mem_address Hex string with the memory address of the sample.
+   * @returns Key of the reference.
+   */
+  static std::string reference_key (const std::string &board_id,
+                                    const std::string &mem_address);
+
+  /**
+   * @brief Fill the index of references from the database.
+   *
+   * @returns Void.
+   */
+  void load_references ();
+
+  /**
+   * Documents waiting to be written, by collection name.
+   */
+  std::unordered_map<std::string, std::vector<bson_value> > queued;
+
+  /**
+   * Number of documents queued since the manager was created.
+   */
+  uint64_t num_queued = 0;
+
+  /**
+   * Number of documents handed to the database since the manager was
+   * created.
+   *
+   * Documents are written in the order they were queued, so a document is
+   * written once num_written reaches the value num_queued had after it
+   * was queued.
+   */
+  uint64_t num_written = 0;
+
+  /**
+   * Set when the writer has to flush without waiting for a full batch.
+   */
+  bool flush_requested = false;
+
+  /**
+   * Set when the writer has to flush everything and stop.
+   */
+  bool stopping = false;
+
+  /**
+   * Protects the queue of documents and the state of the writer.
+   */
+  std::mutex queue_lock;
+
+  /**
+   * Wakes up the writer when there is work to do.
+   */
+  std::condition_variable writer_cv;
+
+  /**
+   * Wakes up the producers when documents have been written.
+   */
+  std::condition_variable written_cv;
+
+  /**
+   * Background thread storing the queued documents.
+   */
+  std::thread writer;
+
+  /**
+   * @brief Forget the references of documents that could not be stored.
+   *
+   * The samples claimed them before they were written, so they would
+   * otherwise stay in the index without a document. A reference that did
+   * reach the database before the error may end up stored twice, which
+   * get_data_vector tolerates.
+   *
+   * @param docs Documents of the references collection.
+   * @returns Void.
+   */
+  void release_references (const std::vector<bson_value> &docs);
+
+  /**
+   * @brief Store the queued documents until the manager is destroyed.
+   *
+   * The writer uses its own client, since clients can not be shared
+   * between threads. Documents are written with one unordered bulk insert
+   * per collection every WRITE_BATCH_SIZE documents or WRITE_FLUSH_MS
+   * milliseconds, whatever happens first.
+   *
+   * @returns Void.
+   */
+  void write_queued ();
+
 public:
   /**
    * @brief Default constructor.
@@ -80,62 +216,111 @@ public:
   /**
    * @brief Default destructor.
    *
+   * Waits for the writer to store every queued document.
    * mongocxx::client does not provide a way to close the connection directly.
    */
-  ~DBManager (){};
+  ~DBManager ();
 
   /**
    * @brief Convert a header into a document.
    *
+   * Does not touch the database.
+   *
    * @param header The header to be converted.
    * @returns The mongodb document.
    */
-  bson_doc header_to_doc (const header_t &header);
+  static bson_doc header_to_doc (const header_t &header);
 
   /**
    * @brief Convert a body into a document.
    *
-   * For bodies carrying memory information, the data gets converted
-   * into a string with comma separated values to preserve space.
+   * For bodies carrying memory information, the data is stored as BSON
+   * binary, one byte per byte of memory. Does not touch the database.
    *
    * @param body The body to be converted.
    * @returns The mongodb document.
    */
-  bson_doc body_to_doc (const body_t &body);
+  static bson_doc body_to_doc (const body_t &body);
 
   /**
-   * @brief Insert one document in the database.
+   * @brief Queue one document to be inserted in the background.
+   *
+   * Blocks while there are WRITE_MAX_PENDING documents waiting to be
+   * written, so a slow database slows down the acquisition instead of
+   * exhausting the memory.
    *
    * @param doc The document to store.
    * @param coll_name The collection to stored the document into.
-   * @returns Optional value with the inserted id or nothing.
+   * @returns Void.
+   */
+  void enqueue (bson_value doc, const std::string &coll_name);
+
+  /**
+   * @brief Wait until the documents queued before the call are written.
+   *
+   * Documents queued by other threads in the meantime are not waited for,
+   * so a steady stream of samples can not hold the caller back.
+   *
+   * @returns Void.
    */
-  MaybeResult insert_one (const bson_doc &doc, const std::string &coll_name);
+  void flush ();
 
   /**
-   * @brief Check if a reference sample already exists.
+   * @brief Register a sample as the reference if there is none yet.
    *
-   * The reference sample is the first sample that is taken
-   * from each board.
+   * Checking and registering happen atomically, so when several threads
+   * read the same region only one of them stores the reference.
    *
    * @param board_id Hex string with the board id.
    * @param mem_address Hex string with the memory address of the sample.
-   * @returns True if the documents exists.
+   * @returns True if the sample has to be stored as the reference.
    */
-  bool reference_present (const std::string &board_id,
-                          const std::string &mem_address);
+  bool claim_reference (const std::string &board_id,
+                        const std::string &mem_address);
 
   /**
    * @brief Get the data from one document.
    *
+   * Documents storing the data as BSON binary are copied as is. Documents
+   * from older versions of the station, storing the data as a string with
+   * comma separated values, are parsed. Queued documents are flushed first
+   * so that a sample that has just been read can be found.
+   *
    * @param board_id Hex string with the board id.
    * @param mem_address Hex string with the memory address of the sample.
    * @returns Vector with the bytes in the sample.
    */
   std::vector<uint8_t> get_data_vector (const std::string &board_id,
                                         const std::string &mem_address);
+
+  /**
+   * @brief Get the data from the references of several blocks at once.
+   *
+   * Same as get_data_vector, with a single flush and a single query for
+   * the whole set of addresses.
+   *
+   * @param board_id Hex string with the board id.
+   * @param mem_addresses Hex strings with the memory addresses.
+   * @returns Bytes of every reference found, by memory address. Addresses
+   * without a reference are left out.
+   */
+  std::unordered_map<std::string, std::vector<uint8_t> >
+  get_data_vectors (const std::string &board_id,
+                    const std::vector<std::string> &mem_addresses);
 };
 
+/**
+ * @brief Parse data stored as a string with comma separated values.
+ *
+ * This is the format used for the data by older versions of the station.
+ *
+ * @param data_str String with the values, e.g. "12,255,0".
+ * @param values Vector where the parsed values are appended.
+ * @returns Void.
+ */
+void parse_data_string (const std::string_view &data_str,
+                        std::vector<uint8_t> &values);
+
 /**
  * @brief Invert the values of an array.
  *
@@ -8,10 +8,18 @@
 
 #pragma once
 
+#include <chrono>
 #include <filesystem>
+#include <functional>
+#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <regex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -30,6 +38,150 @@ using boost::asio::serial_port_base;
  */
 #define NUM_DEVS_PER_CHAIN 10
 
+/**
+ * Directory searched for the serial ports of the chains.
+ *
+ * The STATION_DEV_DIR environment variable takes precedence, e.g. to run
+ * the station against emulated chains.
+ */
+#define DEV_DIR "/dev/"
+
+/**
+ * Number of threads running the I/O context of the serial ports.
+ */
+#define NUM_THREADS_IO 2
+
+/**
+ * Time, in milliseconds, to wait for a header before giving up.
+ *
+ * Has to be larger than the time a header takes to reach the last device of
+ * a chain and its ACK to come back.
+ */
+#define HEADER_TIMEOUT_MS 3000
+
+/**
+ * Time, in milliseconds, to wait for a body before giving up.
+ */
+#define BODY_TIMEOUT_MS 3000
+
+/**
+ * Range reads kept in flight on a chain at once by default.
+ *
+ * A device streams one range at a time, so a window larger than the number
+ * of devices of the chain gains nothing.
+ */
+#define READ_WINDOW NUM_DEVS_PER_CHAIN
+
+/**
+ * Baud rate of the ports when they are registered.
+ *
+ * Devices start at this rate after a reset.
+ */
+#define DEFAULT_BAUD_RATE 115200
+
+/**
+ * Time, in milliseconds, for a BAUD commit to reach the last device of a
+ * chain.
+ */
+#define BAUD_SETTLE_MS 100
+
+/**
+ * Time, in milliseconds, a device keeps a new baud rate without receiving a
+ * header before going back to the previous one.
+ *
+ * Must match BAUD_CONFIRM_MS in the firmware.
+ */
+#define BAUD_CONFIRM_MS 1000
+
+/**
+ * Outcome of reading a frame from a port.
+ */
+enum class frame_status : uint8_t
+{
+  /// The whole frame was received.
+  OK,
+  /// Nothing was received before the deadline.
+  TIMEOUT,
+  /// Only part of the frame was received before the deadline.
+  SHORT_FRAME,
+  /// The port reported an error.
+  IO_ERROR,
+  /// A whole frame was received but its CRC does not match, and no intact
+  /// frame followed before the deadline.
+  BAD_CRC,
+  /// The frame is intact but not the one expected.
+  UNEXPECTED,
+};
+
+/**
+ * Frame received from a port.
+ */
+template <typename T> struct port_frame_t
+{
+  /// Name of the port the frame was read from.
+  std::string port_name;
+  /// Outcome of the read.
+  frame_status status = frame_status::OK;
+  /// Frame received. Only valid when the status is frame_status::OK.
+  T frame = {};
+};
+
+/**
+ * String formatting for frame status.
+ *
+ * Used for error messages and logging purposes
+ */
+template <> struct fmt::formatter<frame_status> : formatter<string_view>
+{
+  template <typename FormatContext>
+  auto
+  format (const frame_status &status, FormatContext &ctx)
+  {
+    string_view name = "unknown";
+    switch (status)
+      {
+      case frame_status::OK:
+        name = "ok";
+        break;
+      case frame_status::TIMEOUT:
+        name = "timeout";
+        break;
+      case frame_status::SHORT_FRAME:
+        name = "short frame";
+        break;
+      case frame_status::IO_ERROR:
+        name = "I/O error";
+        break;
+      case frame_status::BAD_CRC:
+        name = "bad CRC";
+        break;
+      case frame_status::UNEXPECTED:
+        name = "unexpected frame";
+        break;
+      }
+    return formatter<string_view>::format (name, ctx);
+  }
+};
+
+/**
+ * Range read of a device, one of several in flight on a chain.
+ *
+ * @see DeviceManager::read_ranges
+ */
+struct range_request_t
+{
+  /// Header addressed to the device. Its type, argument and sequence number
+  /// are filled in.
+  header_t header;
+  /// First block to read.
+  uint16_t address_offset;
+  /// Number of blocks to read.
+  uint16_t num_blocks;
+  /// Outcome of the read, OK only if every block and the trailer were
+  /// received.
+  frame_status status = frame_status::TIMEOUT;
+};
+
 /**
  * Status of each connected device
  */
@@ -49,8 +201,52 @@ struct dev_status_t
   uint16_t max_ram;
 };
 
+/// Strand used to serialize the operations of a single port
+using port_strand = asio::strand<asio::io_context::executor_type>;
+
+/**
+ * Serial port of a chain.
+ *
+ * Every port has its own strand so that operations on different chains run
+ * concurrently on the I/O threads while operations on the same chain never
+ * overlap. Transactions on the same chain are serialized as a whole, since
+ * the frames of a chain are only told apart by the order they arrive in.
+ */
+struct port_ctx_t
+{
+  /// Strand where all the handlers of the port run.
+  port_strand strand;
+  /// Serial port object bound to the strand.
+  asio::serial_port port;
+  /// Held from the first frame sent by a transaction to the last one
+  /// received.
+  std::mutex transaction_lock;
+  /// Bytes read from the port and not taken as part of a frame yet. Only
+  /// accessed on the strand.
+  std::vector<uint8_t> rx_bytes;
+  /// Sequence number of the last request sent through read_ranges.
+  uint8_t last_seq = 0;
+
+  port_ctx_t (asio::io_context &ctx)
+      : strand (asio::make_strand (ctx)), port (strand){};
+};
+
+/**
+ * Hold on a chain for the length of a transaction.
+ *
+ * The ports stay registered while the guard is alive, so the chain is not
+ * closed under the transaction.
+ */
+struct chain_guard_t
+{
+  /// Shared lock on the ports and devices of the manager.
+  std::shared_lock<std::shared_mutex> registry;
+  /// Lock on the transactions of the chain.
+  std::unique_lock<std::mutex> transaction;
+};
+
 /// Map for port name and serial port object
-using PortMap = std::unordered_map<std::string, asio::serial_port *>;
+using PortMap = std::unordered_map<std::string, std::unique_ptr<port_ctx_t> >;
 
 /// Map for port name and list of devices in the chain
 using DeviceMap = std::unordered_map<std::string, std::vector<dev_status_t> >;
@@ -77,16 +273,208 @@ private:
    */
   DeviceMap devices;
 
+  /**
+   * Lock for the ports and the devices.
+   *
+   * Lookups and transactions take it shared, registering ports or devices
+   * takes it exclusively, so a chain is never closed while in use.
+   */
+  std::shared_mutex registry_lock;
+
   /**
    * Boost asio context to communicate with the devices.
    */
   asio::io_context ctx;
 
+  /**
+   * Keeps the context running while no operation is pending.
+   */
+  asio::executor_work_guard<asio::io_context::executor_type> work;
+
+  /**
+   * Threads running the context.
+   *
+   * @see NUM_THREADS_IO
+   */
+  std::vector<std::thread> io_threads;
+
+  /**
+   * @brief Write a buffer to a port asynchronously.
+   *
+   * The write is started on the strand of the port and completes once every
+   * byte has been written. The buffer must outlive the operation.
+   *
+   * @param port_name Name of the port to write to.
+   * @param buf Buffer with the data to write.
+   * @param len Number of bytes to write.
+   *
+   * @returns Future with the number of bytes written.
+   */
+  std::future<size_t> async_write_frame (const std::string &port_name,
+                                         const uint8_t *buf, const size_t &len);
+
+  /**
+   * @brief Start reading a frame from a port.
+   *
+   * Building block of the asynchronous reads. The handler is called on the
+   * strand of the port with the outcome of the read.
+   *
+   * @param chain Port to read from.
+   * @param buf Buffer to store the frame into, large enough for a body if
+   * len is 0.
+   * @param len Size of the frame, or 0 for either a header or a body.
+   * @param timeout Maximum time to wait for the whole frame.
+   * @param handler Function called once the read finishes.
+   *
+   * @returns Void.
+   */
+  void start_read_frame (port_ctx_t *chain, uint8_t *buf, const size_t &len,
+                         const std::chrono::milliseconds &timeout,
+                         std::function<void (frame_status)> handler);
+
+  /**
+   * @brief Read a frame from a port asynchronously.
+   *
+   * The read is started on the strand of the port and completes once the
+   * whole frame has been received, regardless of how the serial driver splits
+   * it, or once the deadline expires. The buffer must outlive the operation.
+   *
+   * @param port_name Name of the port to read from.
+   * @param buf Buffer to store the frame into, large enough for a body if
+   * len is 0.
+   * @param len Size of the frame, or 0 for either a header or a body.
+   * @param timeout Maximum time to wait for the whole frame.
+   *
+   * @returns Future with the outcome of the read.
+   */
+  std::future<frame_status>
+  async_read_frame (const std::string &port_name, uint8_t *buf,
+                    const size_t &len,
+                    const std::chrono::milliseconds &timeout);
+
+  /**
+   * @brief Take a chain for a transaction.
+   *
+   * Waits for the transaction running on the chain to finish. Bytes left
+   * in the port by a transaction that gave up are dropped, so the frames
+   * read next are the answers to the new one.
+   *
+   * @param port_name Port of the chain.
+   *
+   * @returns Locks on the ports and on the chain, held until the
+   * transaction is over.
+   */
+  chain_guard_t lock_chain (const std::string &port_name);
+
+  /**
+   * @brief Drop the bytes received by a chain and not read yet.
+   *
+   * @param chain Port of the chain.
+   *
+   * @returns Void.
+   */
+  void drop_input (port_ctx_t *chain);
+
+  /**
+   * @brief Number of devices registered in a chain.
+   *
+   * @param port_name Port of the chain.
+   *
+   * @returns Number of devices, 0 if none answered the discovery.
+   */
+  size_t chain_size (const std::string &port_name);
+
+  /**
+   * @brief Open the ports of the chains found in DEV_DIR.
+   *
+   * The ports must be locked exclusively, see registry_lock.
+   *
+   * @returns Void.
+   */
+  void open_ports ();
+
+  /**
+   * @brief Send a header to a port.
+   *
+   * The preamble, the size and the CRC of the header are filled in before
+   * sending it.
+   *
+   * @param port_name Name of the port to write to.
+   * @param header The header to send.
+   *
+   * @returns Void.
+   */
+  void send_header (const std::string &port_name, header_t &header);
+
+  /**
+   * @brief Send a body to a port.
+   *
+   * The preamble, the size and the CRC of the body are filled in before
+   * sending it.
+   *
+   * @param port_name Name of the port to write to.
+   * @param body The body to send.
+   *
+   * @returns Void.
+   */
+  void send_body (const std::string &port_name, body_t &body);
+
+  /**
+   * @brief Count the ACKs of a chain carrying an argument.
+   *
+   * Reading stops at the first header that is not received.
+   *
+   * @param port_name Port of the chain.
+   * @param num_devices Maximum number of ACKs to read.
+   * @param arg Argument the ACKs must carry.
+   *
+   * @returns Number of ACKs received with the argument.
+   */
+  size_t count_acks (const std::string &port_name, const size_t &num_devices,
+                     const uint32_t &arg);
+
+  /**
+   * @brief Discover the devices of a chain.
+   *
+   * The ports must be locked exclusively, see registry_lock.
+   *
+   * @param port_name Port of the chain.
+   *
+   * @returns Devices that answered, in the order of the chain.
+   */
+  std::vector<dev_status_t> discover_chain (const std::string &port_name);
+
+  /**
+   * @brief Send a BAUD commit to a chain and switch its port.
+   *
+   * The port switches once every byte of the commit has been sent.
+   *
+   * @param port_name Port of the chain.
+   * @param baud_rate Baud rate to switch to.
+   *
+   * @returns Void.
+   */
+  void commit_baud_rate (const std::string &port_name,
+                         const uint32_t &baud_rate);
+
+  /**
+   * @brief Switch a chain to another baud rate.
+   *
+   * The chain must be taken already, see lock_chain, or the ports locked
+   * exclusively.
+   *
+   * @see set_baud_rate
+   */
+  bool switch_baud_rate (const std::string &port_name,
+                         const uint32_t &baud_rate);
+
 public:
   /**
    * @brief Default constructor.
+   *
+   * Starts the threads running the I/O context.
    */
-  DeviceManager (){};
+  DeviceManager ();
   /**
    * @brief Default destructor.
    */
@@ -144,30 +532,179 @@ public:
   void power_off ();
 
   /**
-   * @brief Power off the devices connected a port.
+   * @brief Listen for a header in one port.
    *
-   * @see power_on
+   * @param port_name Port to read the header from.
    *
-   * @returns Void.
+   * @returns Header received and outcome of the read.
    */
-  void broadcast_blocking (const uint8_t *buf, const int &len);
+  port_frame_t<header_t> listen_header_block (const std::string &port_name);
 
   /**
-   * @brief Power off the devices connected a port.
+   * @brief Listen for a body in one port.
    *
-   * @see power_on
+   * @param port_name Port to read the body from.
    *
-   * @returns Void.
+   * @returns Body received and outcome of the read.
    */
-  std::vector<std::pair<std::string, header_t> >
-  listen_headers_block (const int num_devices);
+  port_frame_t<body_t> listen_body_block (const std::string &port_name);
 
   /**
-   * @brief Power off the devices connected a port.
+   * @brief Switch a chain to another baud rate.
    *
-   * @see power_on
+   * Every device registered in the chain is asked first if it supports the
+   * rate, and the chain is only switched if all of them do. Each device
+   * passes the commit on before switching, and the port switches once the
+   * commit has left it. The new rate is then confirmed with a PING, which
+   * every device has to answer.
+   *
+   * If the PING is not answered by every device the chain is switched back
+   * and the previous rate is confirmed with another PING. Devices that
+   * missed the confirmation of the new rate return to the previous one on
+   * their own after BAUD_CONFIRM_MS, and ignore the commit back.
+   *
+   * @param port_name Port of the chain.
+   * @param baud_rate Baud rate to switch to.
+   *
+   * @returns True if the chain runs at the new rate, false if it stays at
+   * the previous one.
+   */
+  bool set_baud_rate (const std::string &port_name,
+                      const uint32_t &baud_rate);
+
+  /**
+   * @brief Find the port a device is connected to.
+   *
+   * @param board_id Hex string with the device ID.
+   *
+   * @returns Name of the port or nothing if the device is not registered.
+   */
+  std::optional<std::string> find_port (const std::string &board_id);
+
+  /**
+   * @brief Read one block of memory from a device.
+   *
+   * The READ header is sent to the chain of the device and, once the device
+   * has acknowledged it, the body with the memory offset to read. Devices
+   * only acknowledge once they are ready to receive the body, so the body is
+   * sent right after the ACK. The caller owns both packets so they can be
+   * reused between consecutive blocks, their CRC is filled in before
+   * sending them.
+   *
+   * @param port_name Port the device is connected to.
+   * @param header READ header addressed to the device.
+   * @param body Body with the memory offset to read.
+   *
+   * @returns Body with the contents of the memory and outcome of the
+   * transaction.
+   */
+  port_frame_t<body_t> read_block (const std::string &port_name,
+                                   header_t &header, body_t &body);
+
+  /**
+   * @brief Write one block of memory to a device.
+   *
+   * The WRITE header is sent to the chain of the device and, once the device
+   * has acknowledged it, the body with the values to write.
+   *
+   * @param port_name Port the device is connected to.
+   * @param header WRITE header addressed to the device.
+   * @param body Body with the memory offset and the values to write.
+   *
+   * @returns Outcome of waiting for the acknowledgment of the device.
+   */
+  frame_status write_block (const std::string &port_name, header_t &header,
+                            body_t &body);
+
+  /**
+   * @brief Read a range of consecutive blocks of memory from a device.
+   *
+   * A single RANGE_READ header is sent to the chain of the device, which
+   * streams every block back to back, each in its own body, and ends with a
+   * RANGE_END trailer. Each block is handed to the callback as soon as it
+   * arrives, so blocks read before a failure are not lost.
+   *
+   * @param port_name Port the device is connected to.
+   * @param header Header addressed to the device. Its type and argument are
+   * filled in.
+   * @param address_offset First block to read.
+   * @param num_blocks Number of blocks to read.
+   * @param on_block Function called with every block received.
+   *
+   * @returns Outcome of the transaction, OK only if every block and the
+   * trailer were received.
+   */
+  frame_status
+  read_range (const std::string &port_name, header_t &header,
+              const uint16_t &address_offset, const uint16_t &num_blocks,
+              const std::function<void (const body_t &)> &on_block);
+
+  /**
+   * @brief Read ranges of blocks of memory from several devices of a chain.
+   *
+   * Up to window RANGE_READ headers are kept in flight at once, each with
+   * its own sequence number, so devices stream their blocks while the
+   * requests for the others are still on their way. A device is only sent
+   * a request once the previous one sent to it has finished. Blocks of
+   * different devices arrive interleaved and are handed to the callback as
+   * they arrive, along with the request they answer.
+   *
+   * @param port_name Port of the chain.
+   * @param requests Ranges to read. The outcome of each is stored in it.
+   * @param window Maximum number of requests in flight, up to 255.
+   * @param on_block Function called with every block received.
    *
    * @returns Void.
+   *
+   * @see READ_WINDOW
+   */
+  void read_ranges (const std::string &port_name,
+                    std::vector<range_request_t> &requests,
+                    const size_t &window,
+                    const std::function<void (const range_request_t &,
+                                              const body_t &)> &on_block);
+
+  /**
+   * @brief Read the digest of a range of blocks of memory from a device.
+   *
+   * The device answers the DIGEST header with an ACK carrying the digest of
+   * the blocks, so the range can be compared with a known pattern without
+   * transferring it. A range past the end of SRAM is refused by the device
+   * and reported as UNEXPECTED.
+   *
+   * @param port_name Port the device is connected to.
+   * @param header Header addressed to the device. Its type and argument are
+   * filled in.
+   * @param address_offset First block of the range.
+   * @param num_blocks Number of blocks of the range.
+   * @param digest Digest computed by the device.
+   *
+   * @returns Outcome of waiting for the acknowledgment of the device.
+   *
+   * @see update_digest
+   */
+  frame_status read_digest (const std::string &port_name, header_t &header,
+                            const uint16_t &address_offset,
+                            const uint16_t &num_blocks, uint32_t &digest);
+
+  /**
+   * @brief Read the same block of memory from every device of a chain.
+   *
+   * A single COLLECT header is sent to the chain. Every device sends its
+   * own block up and passes the header on, so the blocks arrive in the
+   * order of the devices in the chain, without a transaction per device.
+   *
+   * @param port_name Port of the chain.
+   * @param address_offset Block to read.
+   * @param on_block Function called with every block received.
+   *
+   * @returns Outcome of the transaction, OK only if a block was received
+   * from every registered device of the chain, UNEXPECTED if a device
+   * refused the block or answered with another one. Those answers are not
+   * handed to the callback.
    */
-  body_t listen_body_block (const std::string &port_name);
+  frame_status
+  read_collective (const std::string &port_name,
+                   const uint16_t &address_offset,
+                   const std::function<void (const body_t &)> &on_block);
 };
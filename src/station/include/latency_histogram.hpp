@@ -0,0 +1,113 @@
+/**
+ * @file latency_histogram.hpp
+ *
+ * @brief Histogram of latencies with a bounded relative error.
+ *
+ * Values are counted in buckets whose width grows with the value, as in an
+ * HDR histogram, so the whole range of a uint64_t is covered with a few
+ * thousand counters and every percentile is reported within 1/64 of its
+ * value.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+/** Buckets per power of two, which sets the precision of the histogram */
+#define HISTOGRAM_SUB_BUCKETS 64
+
+/**
+ * Counts of values, usually latencies.
+ *
+ * The unit is the one of the values recorded: the tracer records
+ * nanoseconds, which /metrics/latency reports in microseconds, and the load
+ * generator records microseconds.
+ *
+ * A histogram is not synchronized. Every thread records into its own and
+ * the histograms are merged to be reported.
+ */
+class LatencyHistogram
+{
+  /**
+   * Number of values recorded in each bucket.
+   */
+  std::vector<uint64_t> counts;
+
+  /**
+   * Number of values recorded.
+   */
+  uint64_t total = 0;
+
+  /**
+   * Sum of the values recorded.
+   */
+  uint64_t sum = 0;
+
+  /**
+   * Lowest value recorded.
+   */
+  uint64_t lowest = UINT64_MAX;
+
+  /**
+   * Highest value recorded.
+   */
+  uint64_t highest = 0;
+
+public:
+  LatencyHistogram ();
+
+  /**
+   * @brief Record one value.
+   *
+   * @param value The value, e.g. a latency in nanoseconds.
+   * @returns Void.
+   */
+  void record (const uint64_t &value);
+
+  /**
+   * @brief Add the values of another histogram to this one.
+   *
+   * @param other The histogram to add.
+   * @returns Void.
+   */
+  void merge (const LatencyHistogram &other);
+
+  /**
+   * @brief Forget every value recorded.
+   *
+   * @returns Void.
+   */
+  void reset ();
+
+  /**
+   * @brief Value below which a percentage of the values fall.
+   *
+   * @param percentile Percentage of the values, from 0 to 100.
+   * @returns The highest value of the bucket the percentile falls in, or 0
+   * if the histogram is empty.
+   */
+  uint64_t percentile (const double &percentile) const;
+
+  /**
+   * @brief Number of values recorded.
+   */
+  uint64_t count () const;
+
+  /**
+   * @brief Lowest value recorded, 0 if the histogram is empty.
+   */
+  uint64_t min () const;
+
+  /**
+   * @brief Highest value recorded.
+   */
+  uint64_t max () const;
+
+  /**
+   * @brief Mean of the values recorded, 0 if the histogram is empty.
+   */
+  double mean () const;
+};
@@ -0,0 +1,224 @@
+/**
+ * @file latency_tracer.hpp
+ *
+ * @brief Timing of the stages of every transaction of the station.
+ *
+ * Each stage is timed with a span, whose duration is added to the
+ * histogram of the stage. The most recent spans are also kept, to be
+ * dumped in the Chrome trace format and looked at in chrome://tracing or
+ * Perfetto.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "include/latency_histogram.hpp"
+
+/** Number of stages timed */
+#define TRACE_NUM_STAGES 15
+
+/** Spans kept by every thread for the trace dump */
+#define TRACE_RECENT_SPANS 4096
+
+/**
+ * Stages of a transaction.
+ *
+ * The requests are spans of their own, enclosing the stages they go
+ * through. Writes to the databases happen later, in the threads that
+ * batch them.
+ */
+enum class trace_stage : uint8_t
+{
+  /** Whole /commands/read request */
+  READ,
+  /** Whole /commands/write_invert request */
+  WRITE_INVERT,
+  /** Parse the request */
+  PARSE,
+  /** Send a header to a chain */
+  SEND_HEADER,
+  /** Wait for a header from a chain, an ACK or a trailer */
+  WAIT_HEADER,
+  /** Send a body to a chain */
+  SEND_BODY,
+  /** Wait for a body from a chain */
+  WAIT_BODY,
+  /** Check and register the reference of a block */
+  CLAIM_REFERENCE,
+  /** Get the reference of a block from the database */
+  GET_REFERENCE,
+  /** Convert a body into a document */
+  BODY_TO_DOC,
+  /** Queue a document to be stored */
+  ENQUEUE,
+  /** Queue a point for InfluxDB */
+  LOG,
+  /** Build the response */
+  RESPONSE,
+  /** Write a batch of documents to MongoDB */
+  DB_WRITE,
+  /** Write a batch of points to InfluxDB */
+  INFLUX_WRITE,
+};
+
+/**
+ * Names of the stages, as reported by the station.
+ */
+extern const char *stage_name[TRACE_NUM_STAGES];
+
+/**
+ * Span recorded for the trace dump.
+ */
+typedef struct
+{
+  /** Start of the span in nanoseconds since the tracer was created */
+  uint64_t start_ns;
+  /** Duration of the span in nanoseconds */
+  uint64_t duration_ns;
+  trace_stage stage;
+} trace_span_t;
+
+/**
+ * Spans recorded by one thread.
+ *
+ * The lock is only contended while the spans are reported.
+ */
+typedef struct
+{
+  std::mutex lock;
+  /** Durations of every stage in nanoseconds */
+  std::array<LatencyHistogram, TRACE_NUM_STAGES> stages;
+  /** Ring of the most recent spans */
+  std::vector<trace_span_t> recent;
+  /** Number of spans recorded, the next one goes at next % size */
+  uint64_t next = 0;
+  /** Thread of the spans, as shown in the trace */
+  uint32_t tid;
+} trace_shard_t;
+
+/**
+ * Histograms and recent spans of every stage.
+ *
+ * There is one tracer in the station, see latency_tracer.
+ */
+class LatencyTracer
+{
+  /**
+   * Shards of the running threads that have recorded spans.
+   */
+  std::vector<std::unique_ptr<trace_shard_t>> shards;
+
+  /**
+   * Durations of every stage recorded by the threads that have exited.
+   */
+  std::array<LatencyHistogram, TRACE_NUM_STAGES> retired;
+
+  /**
+   * Lock for the list of shards and the retired durations.
+   */
+  std::mutex shards_lock;
+
+  /**
+   * Thread ID given to the next shard.
+   */
+  uint32_t next_tid = 1;
+
+  /**
+   * Time the spans are counted from.
+   */
+  std::chrono::steady_clock::time_point epoch;
+
+  /**
+   * Owner of the shard of a thread, retires it when the thread exits.
+   */
+  struct thread_shard;
+
+  /**
+   * @brief Shard of the calling thread, created on its first span.
+   */
+  trace_shard_t &local_shard ();
+
+  /**
+   * @brief Add the durations of a shard to the retired ones and free it.
+   *
+   * The recent spans of the shard are dropped from the trace.
+   *
+   * @param shard Shard of a thread that exits.
+   * @returns Void.
+   */
+  void retire (trace_shard_t *shard);
+
+public:
+  LatencyTracer ();
+
+  /**
+   * @brief Record a span.
+   *
+   * @param stage Stage the span times.
+   * @param start Time the stage started.
+   * @param end Time the stage ended.
+   * @returns Void.
+   */
+  void record (const trace_stage &stage,
+               const std::chrono::steady_clock::time_point &start,
+               const std::chrono::steady_clock::time_point &end);
+
+  /**
+   * @brief Durations of every stage, from every thread.
+   *
+   * @returns One histogram per stage, in nanoseconds.
+   */
+  std::array<LatencyHistogram, TRACE_NUM_STAGES> histograms ();
+
+  /**
+   * @brief Recent spans in the Chrome trace format.
+   *
+   * @returns JSON with a complete event per span.
+   */
+  std::string chrome_trace ();
+
+  /**
+   * @brief Forget every span recorded.
+   *
+   * @returns Void.
+   */
+  void reset ();
+};
+
+/**
+ * @brief Tracer of the station.
+ */
+LatencyTracer &latency_tracer ();
+
+/**
+ * Times a stage from its construction to its destruction.
+ */
+class TraceSpan
+{
+  trace_stage stage;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit TraceSpan (const trace_stage &stage)
+      : stage (stage), start (std::chrono::steady_clock::now ())
+  {
+  }
+
+  ~TraceSpan ()
+  {
+    latency_tracer ().record (this->stage, this->start,
+                              std::chrono::steady_clock::now ());
+  }
+
+  TraceSpan (const TraceSpan &) = delete;
+  TraceSpan &operator= (const TraceSpan &) = delete;
+};
@@ -9,10 +9,24 @@
 #pragma once
 
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+
+#include <boost/asio.hpp>
 
 #include "include/influxdb.hpp"
 
+/** Default time between two writes of the logged points */
+#define LOG_FLUSH_MS 1000
+
+/** Default number of points that triggers a write before the interval */
+#define LOG_MAX_BATCH 5000
+
+/** Points queued beyond this many batches are dropped */
+#define LOG_MAX_BATCHES_QUEUED 4
+
 /// InfluxDB Manager for logging capabilities
 /// Measurements:
 ///   - sensors
@@ -36,6 +50,84 @@ private:
    */
   influxdb_cpp::server_info server;
 
+  /**
+   * Time between two writes of the logged points.
+   */
+  std::chrono::milliseconds flush_interval;
+
+  /**
+   * Number of points that triggers a write before the interval elapses.
+   */
+  size_t max_batch;
+
+  /**
+   * Points in line protocol waiting to be written, one per line.
+   */
+  std::string batch;
+
+  /**
+   * Number of points in the batch.
+   */
+  size_t batch_size = 0;
+
+  /**
+   * Set when the flusher has to write the last points and stop.
+   */
+  bool stopping = false;
+
+  /**
+   * Protects the batch and the state of the flusher.
+   */
+  std::mutex batch_lock;
+
+  /**
+   * Wakes up the flusher when the batch is full or the logger stops.
+   */
+  std::condition_variable flusher_cv;
+
+  /**
+   * Context of the connection to InfluxDB. Only used by the flusher.
+   */
+  boost::asio::io_context ctx;
+
+  /**
+   * Keep-alive connection to InfluxDB, opened on the first write.
+   */
+  boost::asio::ip::tcp::socket socket;
+
+  /**
+   * Background thread writing the batches.
+   */
+  std::thread flusher;
+
+  /**
+   * @brief Queue one point to be written with the next batch.
+   *
+   * @param point The point built with influxdb_cpp, with its timestamp.
+   *
+   * @return Void.
+   */
+  void push (const influxdb_cpp::builder &point);
+
+  /**
+   * @brief Write the batches until the logger is destroyed.
+   *
+   * @return Void.
+   */
+  void flush_batches ();
+
+  /**
+   * @brief Write one batch with a single request to InfluxDB.
+   *
+   * The connection is reused between requests, and opened again if the
+   * server closed it.
+   *
+   * @param lines Points in line protocol, one per line.
+   *
+   * @return True if InfluxDB accepted the points.
+   */
+  bool write_batch (const std::string &lines);
+
 public:
   /**
    * @brief Default constructor.
@@ -48,14 +140,21 @@ public:
    * @param host Host for the connection to InfluxDB.
    * @param port Port for the connection to InfluxDB.
    * @param db Name of the InfluxDB database.
+   * @param flush_interval Time between two writes of the logged points.
+   * @param max_batch Number of points that triggers a write before the
+   * interval elapses.
    */
-  Logger (const std::string &host, const int &port, const std::string &db)
-      : server (host, port, db){};
+  Logger (const std::string &host, const int &port, const std::string &db,
+          const std::chrono::milliseconds &flush_interval
+          = std::chrono::milliseconds (LOG_FLUSH_MS),
+          const size_t &max_batch = LOG_MAX_BATCH);
 
   /**
    * @brief Default destructor.
+   *
+   * Writes the points still in the batch.
    */
-  ~Logger (){};
+  ~Logger ();
 
   /**
    * @brief Register a connected port.
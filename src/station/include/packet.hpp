@@ -12,6 +12,7 @@
 
 #include <cstdint>
 #include <map>
+#include <string>
 
 #include <fmt/core.h>
 #include <fmt/format.h>
@@ -25,6 +26,50 @@
  */
 #define PAYLOAD_SIZE 512
 
+/**
+ * Number of blocks of PAYLOAD_SIZE bytes in the SRAM of a device.
+ *
+ * The STM32L152RE has 80 KB of SRAM. Devices refuse ranges past its end.
+ */
+#define SRAM_NUM_BLOCKS 160
+
+/**
+ * Initial value of the CRC-16.
+ *
+ * The CRC used is CRC-16/MODBUS, reflected polynomial 0xA001.
+ *
+ * @see compute_crc
+ */
+#define CRC_INIT 0xFFFF
+
+/**
+ * Initial value of the digest of a region of memory.
+ *
+ * The digest used is FNV-1a, 32 bits.
+ *
+ * @see update_digest
+ */
+#define DIGEST_INIT 0x811C9DC5
+
+/**
+ * Preamble at the start of every frame, sent as 0xA5 0x5A.
+ *
+ * It is followed by the size of the frame, so that a reader which lost
+ * track of the frames can find the start of the next one.
+ *
+ * @see frame_start
+ */
+#define FRAME_SYNC 0x5AA5
+
+/**
+ * Flag of the argument of a BAUD header to switch to the rate it carries.
+ *
+ * Without it the header only asks the devices if they support the rate.
+ *
+ * @see header_type
+ */
+#define BAUD_COMMIT 0x80000000
+
 /**
  * Operations that can be carried out.
  *
@@ -44,6 +89,18 @@ enum class header_type : uint8_t
   WRITE = 4,
   /// Execute code stored in memory.
   EXEC = 5,
+  /// Propose or commit a new baud rate for a chain.
+  BAUD = 9,
+  /// Read several consecutive blocks of memory.
+  RANGE_READ = 10,
+  /// End of the blocks of a range read.
+  RANGE_END = 11,
+  /// Digest of a range of blocks of memory.
+  DIGEST = 12,
+  /// Read the same block of memory from every device of a chain.
+  COLLECT = 13,
+  /// Refusal of a block outside of memory.
+  NACK = 14,
   /// Error during the communication.
   ERR = 255
 };
@@ -73,6 +130,18 @@ enum class body_type : uint8_t
  */
 typedef struct header_t
 {
+  /**
+   * Preamble of the frame.
+   *
+   * @see FRAME_SYNC
+   */
+  uint16_t sync = FRAME_SYNC;
+
+  /**
+   * Size of the frame in bytes, preamble included.
+   */
+  uint16_t length = sizeof (header_t);
+
   /**
    * Type of operation to be carried out.
    *
@@ -92,9 +161,22 @@ typedef struct header_t
   uint8_t TTL;
 
   /**
-   * Error Correction Code to check the integrity of the header
+   * Sequence number of the request.
+   *
+   * Chosen by the station and copied by the devices into every frame sent
+   * in answer, so that several requests can be in flight on a chain and
+   * their answers told apart.
+   */
+  uint8_t seq = 0;
+
+  /**
+   * CRC-16 to check the integrity of the header.
+   *
+   * Computed over every other field of the header.
+   *
+   * @see header_crc
    */
-  uint8_t CRC;
+  uint16_t CRC;
 
   /**
    * Upper 32 bits to represent the ID of the device.
@@ -123,8 +205,29 @@ typedef struct header_t
    * @see bid_high
    */
   uint32_t bid_low;
+
+  /**
+   * Argument of the operation.
+   *
+   * BAUD headers carry the baud rate. Devices answer a proposal with the
+   * rate if they support it, or 0 otherwise.
+   *
+   * RANGE_READ and DIGEST headers carry the first block in the lower 16 bits
+   * and the number of blocks in the upper 16 bits. The RANGE_END trailer
+   * carries the number of blocks sent, and the ACK of a DIGEST the digest of
+   * the blocks.
+   *
+   * COLLECT headers carry the block to read in the lower 16 bits and the
+   * number of devices in the chain in the upper 16 bits. Devices answer a
+   * block past SRAM_NUM_BLOCKS with a NACK instead of the block.
+   *
+   * @see BAUD_COMMIT
+   */
+  uint32_t arg = 0;
 } __attribute__ ((packed)) header_t;
 
+static_assert (sizeof (header_t) == 25, "header_t must match the firmware");
+
 /**
  * String formatting for headers.
  *
@@ -145,8 +248,8 @@ template <> struct fmt::formatter<header_t>
   {
     auto bid = fmt::format ("0x{0:08X}{1:08X}{2:08X}", h.bid_high,
                             h.bid_medium, h.bid_low);
-    return format_to (ctx.out (), "[{:d}, {:d}, {:#x}, {}]", h.type, h.TTL,
-                      h.CRC, bid);
+    return format_to (ctx.out (), "[{:d}, {:d}, {:#x}, {}, {:#x}]", h.type,
+                      h.TTL, h.CRC, bid, h.arg);
   }
 };
 
@@ -157,6 +260,18 @@ template <> struct fmt::formatter<header_t>
  */
 typedef struct body_t
 {
+  /**
+   * Preamble of the frame.
+   *
+   * @see FRAME_SYNC
+   */
+  uint16_t sync = FRAME_SYNC;
+
+  /**
+   * Size of the frame in bytes, preamble included.
+   */
+  uint16_t length = sizeof (body_t);
+
   /**
    * Type of data the body contains.
    *
@@ -165,11 +280,22 @@ typedef struct body_t
   uint8_t type;
 
   /**
-   * Error correction code for the communication.
-   * It is crucial that not a single bit is change in the data
-   * when transmitting the memory from the boards nor when
+   * Sequence number of the request the body belongs to.
+   *
+   * @see header_t::seq
    */
-  uint8_t CRC;
+  uint8_t seq = 0;
+
+  /**
+   * CRC-16 to check the integrity of the body.
+   *
+   * It is crucial that not a single bit is changed in the data when
+   * transmitting the memory from the boards nor when writing to them. The
+   * CRC is computed over every other field of the body, data included.
+   *
+   * @see body_crc
+   */
+  uint16_t CRC;
 
   /**
    * Upper 32 bits to represent the ID of the device.
@@ -204,6 +330,8 @@ typedef struct body_t
   uint8_t data[PAYLOAD_SIZE] = { 0 };
 } __attribute__ ((packed)) body_t;
 
+static_assert (sizeof (body_t) == 534, "body_t must match the firmware");
+
 /**
  * String formatting for bodies.
  *
@@ -244,6 +372,20 @@ template <> struct fmt::formatter<body_t>
   }
 };
 
+/**
+ * @brief Continue the computation of a CRC-16 with more data.
+ *
+ * Allows computing the CRC of data which is not contiguous in memory.
+ * The buffer is processed 8 bytes at a time with slicing-by-8 tables.
+ *
+ * @param crc CRC of the data processed so far.
+ * @param buf buffer to read the data from.
+ * @param len size of the buffer.
+ *
+ * @return CRC-16 of the data processed so far plus the buffer.
+ */
+uint16_t update_crc (uint16_t crc, const uint8_t *buf, const size_t &len);
+
 /**
  * @brief Compute the CRC-16 of some data.
  *
@@ -253,3 +395,99 @@ template <> struct fmt::formatter<body_t>
  * @return CRC-16 of the buffer.
  */
 uint16_t compute_crc (const uint8_t *buf, const size_t &len);
+
+/**
+ * @brief Continue the computation of a digest with more data.
+ *
+ * Devices compute the same digest over their memory, so a region can be
+ * compared without transferring it.
+ *
+ * @param digest Digest of the data processed so far.
+ * @param buf buffer to read the data from.
+ * @param len size of the buffer.
+ *
+ * @return Digest of the data processed so far plus the buffer.
+ */
+uint32_t update_digest (uint32_t digest, const uint8_t *buf,
+                        const size_t &len);
+
+/**
+ * @brief Compute the CRC-16 of a header.
+ *
+ * @param header The header. Its CRC field is not taken into account.
+ *
+ * @return CRC-16 of the header.
+ */
+uint16_t header_crc (const header_t &header);
+
+/**
+ * @brief Compute the CRC-16 of a body.
+ *
+ * @param body The body. Its CRC field is not taken into account.
+ *
+ * @return CRC-16 of the body.
+ */
+uint16_t body_crc (const body_t &body);
+
+/**
+ * @brief Find where a frame starts in the bytes read from a chain.
+ *
+ * A frame starts with FRAME_SYNC followed by its size. Bytes past the end
+ * of the buffer are not known yet, so a preamble cut by the end of the
+ * buffer is taken as a possible start.
+ *
+ * @param buf Bytes read.
+ * @param num_bytes Number of bytes read.
+ * @param len Size of the frame expected, or 0 for either a header or a
+ * body.
+ * @param from First offset to look at.
+ *
+ * @return Offset of the first byte from which may start a frame, or
+ * num_bytes if none can.
+ */
+size_t frame_start (const uint8_t *buf, const size_t &num_bytes,
+                    const size_t &len, const size_t &from);
+
+/**
+ * @brief Size of a frame read from a chain.
+ *
+ * @param buf Bytes of the frame, at least up to its size.
+ *
+ * @return Size of the frame in bytes, preamble included.
+ */
+size_t frame_length (const uint8_t *buf);
+
+/**
+ * @brief Check the CRC of a frame read from a chain.
+ *
+ * @param buf Bytes of the frame.
+ * @param len Size of the frame, which tells a header from a body.
+ *
+ * @return Whether the CRC of the frame matches.
+ */
+bool frame_intact (const uint8_t *buf, const size_t &len);
+
+/**
+ * @brief Format the ID of a device as an hex string.
+ *
+ * @param high Upper 32 bits of the ID.
+ * @param medium Medium 32 bits of the ID.
+ * @param low Lower 32 bits of the ID.
+ *
+ * @return Hex string with the device ID, in the form 0x<24 hex digits>.
+ */
+std::string format_board_id (const uint32_t &high, const uint32_t &medium,
+                             const uint32_t &low);
+
+/**
+ * @brief Split the hex string of a device ID into its three parts.
+ *
+ * @param board_id Hex string with the device ID.
+ * @param high Upper 32 bits of the ID.
+ * @param medium Medium 32 bits of the ID.
+ * @param low Lower 32 bits of the ID.
+ *
+ * @throws std::invalid_argument If the string is not a valid ID.
+ */
+void parse_board_id (const std::string &board_id, uint32_t &high,
+                     uint32_t &medium, uint32_t &low);
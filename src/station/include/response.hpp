@@ -0,0 +1,76 @@
+/**
+ * @file response.hpp
+ *
+ * @brief Function prototypes for the responses of the station.
+ *
+ * Memory read from the boards can be returned in several formats, chosen
+ * by the client with the Accept header or the format query parameter.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "include/packet.hpp"
+
+/**
+ * Formats in which a block of memory can be returned.
+ */
+enum class response_format : uint8_t
+{
+  /** JSON indented for humans, with the data as comma separated values */
+  PRETTY_JSON,
+  /** JSON without whitespace, with the data encoded in base64 */
+  COMPACT_JSON,
+  /** The bytes of the block, without any encoding */
+  BINARY,
+};
+
+/**
+ * @brief Choose the format of the response for a client.
+ *
+ * The format query parameter ("json", "base64" or "binary") takes
+ * precedence over the Accept header. Clients accepting
+ * application/octet-stream get the raw bytes. Anything else gets the
+ * pretty JSON.
+ *
+ * @param accept Value of the Accept header of the request.
+ * @param format Value of the format query parameter of the request.
+ * @returns The format of the response.
+ */
+response_format negotiate_format (const std::string &accept,
+                                  const std::string &format);
+
+/**
+ * @brief Return the MIME type of a format.
+ *
+ * @param format The format of the response.
+ * @returns Value for the Content-Type header.
+ */
+const char *content_type (const response_format &format);
+
+/**
+ * @brief Encode data in base64, with padding.
+ *
+ * @param data Data to encode.
+ * @param len Number of bytes to encode.
+ * @returns The encoded data.
+ */
+std::string encode_base64 (const uint8_t *data, const size_t &len);
+
+/**
+ * @brief Build the response of a memory read.
+ *
+ * @param format The format of the response.
+ * @param board_id Hex string with the board id.
+ * @param mem_address Hex string with the memory address of the block.
+ * @param body Body with the data of the block.
+ * @returns The content of the response.
+ */
+std::string read_response (const response_format &format,
+                           const std::string &board_id,
+                           const std::string &mem_address,
+                           const body_t &body);
@@ -23,8 +23,18 @@
 
 /**
  * Number of threads the server will use.
+ *
+ * served sends the response once the handler returns, so the handlers of
+ * the endpoints that talk to the devices wait for the I/O threads of
+ * DeviceManager and hold a worker for the whole transaction. Transactions
+ * on a chain are serialized, so a slow chain holds one worker in I/O and
+ * one more per request queued behind it. The pool is large enough for
+ * several such requests to wait on each chain while the endpoints that
+ * only read the database and the metrics are still answered.
+ *
+ * @see NUM_THREADS_IO
  */
-#define NUM_THREADS_API 2
+#define NUM_THREADS_API 16
 
 /**
  * @brief Station.
@@ -1,8 +1,10 @@
+#include <charconv>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <utility>
 
 #include "include/db_manager.hpp"
+#include "include/latency_tracer.hpp"
 #include "include/packet.hpp"
 
 using bsoncxx::builder::basic::kvp;
@@ -23,15 +25,58 @@ std::map<uint8_t, std::string> packet_name
 DBManager::DBManager ()
 {
   this->client_uri = mongocxx::uri ("mongodb://localhost:27017");
+  this->db_name = "SRAM";
   this->client = mongocxx::client (client_uri);
-  this->db = client["SRAM"];
+  this->db = client[this->db_name];
+  this->load_references ();
+  this->writer = std::thread (&DBManager::write_queued, this);
 }
 
 DBManager::DBManager (const std::string &uri, const std::string &db_name)
 {
   this->client_uri = mongocxx::uri (uri);
+  this->db_name = db_name;
   this->client = mongocxx::client (client_uri);
   this->db = client[db_name];
+  this->load_references ();
+  this->writer = std::thread (&DBManager::write_queued, this);
+}
+
+DBManager::~DBManager ()
+{
+  {
+    std::lock_guard<std::mutex> guard (this->queue_lock);
+    this->stopping = true;
+  }
+  this->writer_cv.notify_one ();
+  this->writer.join ();
+}
+
+std::string
+DBManager::reference_key (const std::string &board_id,
+                          const std::string &mem_address)
+{
+  return board_id + mem_address;
+}
+
+void
+DBManager::load_references ()
+{
+  mongocxx::options::find opts;
+  opts.projection (
+      make_document (kvp ("board_id", 1), kvp ("mem_address", 1)));
+
+  auto cursor = this->db["references"].find (make_document (), opts);
+
+  std::unique_lock<std::shared_mutex> guard (this->references_lock);
+  this->references.clear ();
+
+  for (auto &doc : cursor)
+    {
+      auto board_id = doc["board_id"].get_utf8 ().value.to_string ();
+      auto mem_address = doc["mem_address"].get_utf8 ().value.to_string ();
+      this->references.insert (reference_key (board_id, mem_address));
+    }
 }
 
 std::vector<uint8_t>
@@ -67,15 +112,16 @@ DBManager::header_to_doc (const header_t &header)
 bson_doc
 DBManager::body_to_doc (const body_t &body)
 {
+  TraceSpan span (trace_stage::BODY_TO_DOC);
+
   auto doc = bson_doc{};
-  auto data_arr = bsoncxx::builder::basic::array{};
 
-  std::string bid = fmt::format ("0x{0:08X}{1:08X}{2:08X}", body.bid_high,
-                                 body.bid_medium, body.bid_low);
+  std::string bid
+      = format_board_id (body.bid_high, body.bid_medium, body.bid_low);
 
   auto date = bsoncxx::types::b_date (std::chrono::system_clock::now ());
-  auto mem_address
-      = fmt::format ("0x{:08x}", body.address_offset * PAYLOAD_SIZE);
+  auto mem_address = fmt::format (
+      "0x{:08x}", (uint32_t)body.address_offset * PAYLOAD_SIZE);
 
   doc.append (kvp ("packet_type", packet_name[body.type]));
   doc.append (kvp ("CRC", body.CRC));
@@ -83,57 +129,225 @@ DBManager::body_to_doc (const body_t &body)
   doc.append (kvp ("timestamp", date));
   doc.append (kvp ("mem_address", mem_address));
 
-  std::stringstream data_ss;
+  doc.append (kvp ("data", bsoncxx::types::b_binary{
+                               bsoncxx::binary_sub_type::k_binary,
+                               PAYLOAD_SIZE, body.data }));
 
-  for (int byte = 0; byte < 511; ++byte)
-    data_ss << (int)body.data[byte] << ",";
-  data_ss << (int)body.data[511];
+  return doc;
+}
 
-  doc.append (kvp ("data", data_ss.str ()));
+void
+DBManager::enqueue (bson_value doc, const std::string &coll_name)
+{
+  TraceSpan span (trace_stage::ENQUEUE);
 
-  return doc;
+  std::unique_lock<std::mutex> guard (this->queue_lock);
+  this->written_cv.wait (guard, [this] {
+    return this->num_queued - this->num_written < WRITE_MAX_PENDING;
+  });
+
+  this->queued[coll_name].push_back (std::move (doc));
+  this->num_queued++;
+
+  if (this->num_queued - this->num_written >= WRITE_BATCH_SIZE)
+    this->writer_cv.notify_one ();
 }
 
-MaybeResult
-DBManager::insert_one (const bson_doc &doc, const std::string &coll_name)
+void
+DBManager::flush ()
 {
-  auto coll = this->db[coll_name];
+  std::unique_lock<std::mutex> guard (this->queue_lock);
+  uint64_t target = this->num_queued;
+  if (this->num_written >= target)
+    return;
 
-  auto view = doc.view ();
-  auto result = coll.insert_one (view);
-  return result;
+  this->flush_requested = true;
+  this->writer_cv.notify_one ();
+  this->written_cv.wait (
+      guard, [this, target] { return this->num_written >= target; });
+}
+
+void
+DBManager::release_references (const std::vector<bson_value> &docs)
+{
+  std::unique_lock<std::shared_mutex> guard (this->references_lock);
+  for (const auto &doc : docs)
+    {
+      auto view = doc.view ();
+      auto board_id = view["board_id"].get_utf8 ().value.to_string ();
+      auto mem_address = view["mem_address"].get_utf8 ().value.to_string ();
+      this->references.erase (reference_key (board_id, mem_address));
+    }
+}
+
+void
+DBManager::write_queued ()
+{
+  mongocxx::client writer_client (this->client_uri);
+  auto writer_db = writer_client[this->db_name];
+
+  mongocxx::options::insert opts;
+  opts.ordered (false);
+
+  std::unique_lock<std::mutex> guard (this->queue_lock);
+  while (true)
+    {
+      this->writer_cv.wait_for (
+          guard, std::chrono::milliseconds (WRITE_FLUSH_MS), [this] {
+            return this->stopping || this->flush_requested
+                   || this->num_queued - this->num_written
+                          >= WRITE_BATCH_SIZE;
+          });
+
+      this->flush_requested = false;
+      if (this->num_queued == this->num_written)
+        {
+          if (this->stopping)
+            break;
+          continue;
+        }
+
+      // Producers can keep queueing while the batch is written
+      auto batch = std::exchange (this->queued, {});
+      guard.unlock ();
+
+      size_t batch_size = 0;
+      for (auto &[coll_name, docs] : batch)
+        {
+          batch_size += docs.size ();
+          try
+            {
+              TraceSpan span (trace_stage::DB_WRITE);
+              writer_db[coll_name].insert_many (docs, opts);
+            }
+          catch (std::exception &e)
+            {
+              std::cerr << "Could not store " << docs.size ()
+                        << " documents in " << coll_name << ": "
+                        << e.what () << "\n";
+
+              // The next read of these blocks becomes the reference
+              if (coll_name == "references")
+                this->release_references (docs);
+            }
+        }
+
+      guard.lock ();
+      this->num_written += batch_size;
+      this->written_cv.notify_all ();
+    }
 }
 
 bool
-DBManager::reference_present (const std::string &board_id,
-                              const std::string &mem_address)
+DBManager::claim_reference (const std::string &board_id,
+                            const std::string &mem_address)
 {
-  auto cursor = db["references"].find (make_document (
-      kvp ("board_id", board_id), kvp ("mem_address", mem_address)));
-  return std::distance (cursor.begin (), cursor.end ()) > 0;
+  TraceSpan span (trace_stage::CLAIM_REFERENCE);
+
+  auto key = reference_key (board_id, mem_address);
+
+  // Once every region has its reference, samples only need to look it up
+  {
+    std::shared_lock<std::shared_mutex> guard (this->references_lock);
+    if (this->references.count (key))
+      return false;
+  }
+
+  std::unique_lock<std::shared_mutex> guard (this->references_lock);
+  return this->references.insert (std::move (key)).second;
+}
+
+/// Bytes of a sample, stored as BSON binary or by older versions of the
+/// station as a string of comma separated values
+static std::vector<uint8_t>
+document_data (const bsoncxx::document::view &doc)
+{
+  std::vector<uint8_t> values;
+
+  bsoncxx::document::element ele = doc["data"];
+  switch (ele.type ())
+    {
+    case bsoncxx::type::k_binary:
+      {
+        auto bin = ele.get_binary ();
+        values.assign (bin.bytes, bin.bytes + bin.size);
+        break;
+      }
+    case bsoncxx::type::k_utf8:
+      {
+        auto str = ele.get_utf8 ().value;
+        values.reserve (PAYLOAD_SIZE);
+        parse_data_string (std::string_view (str.data (), str.size ()),
+                           values);
+        break;
+      }
+    default:
+      break;
+    }
+
+  return values;
 }
 
 std::vector<uint8_t>
 DBManager::get_data_vector (const std::string &board_id,
                             const std::string &mem_address)
 {
-  std::vector<uint8_t> values;
+  TraceSpan span (trace_stage::GET_REFERENCE);
 
-  auto cursor = this->db["references"].find (make_document (
+  this->flush ();
+
+  auto doc = this->db["references"].find_one (make_document (
       kvp ("board_id", board_id), kvp ("mem_address", mem_address)));
 
+  if (!doc)
+    return {};
+
+  return document_data (doc->view ());
+}
+
+std::unordered_map<std::string, std::vector<uint8_t> >
+DBManager::get_data_vectors (const std::string &board_id,
+                             const std::vector<std::string> &mem_addresses)
+{
+  TraceSpan span (trace_stage::GET_REFERENCE);
+
+  this->flush ();
+
+  bsoncxx::builder::basic::array addresses;
+  for (const auto &mem_address : mem_addresses)
+    addresses.append (mem_address);
+
+  auto cursor = this->db["references"].find (make_document (
+      kvp ("board_id", board_id),
+      kvp ("mem_address",
+           make_document (kvp ("$in", addresses.view ())))));
+
+  std::unordered_map<std::string, std::vector<uint8_t> > samples;
   for (auto &doc : cursor)
     {
-      bsoncxx::document::element ele = doc["data"];
-      std::string data_str = ele.get_utf8 ().value.to_string ();
-      std::vector<std::string> split_bytes;
+      auto mem_address = doc["mem_address"].get_utf8 ().value.to_string ();
+      samples[mem_address] = document_data (doc);
+    }
 
-      std::stringstream ss (data_str);
-      std::string item;
-      while (std::getline (ss, item, ','))
-        {
-          values.push_back (std::stoi (item));
-        }
+  return samples;
+}
+
+void
+parse_data_string (const std::string_view &data_str,
+                   std::vector<uint8_t> &values)
+{
+  const char *pos = data_str.data ();
+  const char *end = pos + data_str.size ();
+
+  while (pos < end)
+    {
+      unsigned int value = 0;
+      auto [next, ec] = std::from_chars (pos, end, value);
+      if (ec != std::errc ())
+        break;
+
+      values.push_back (value);
+      // Skip the separator
+      pos = next + 1;
     }
-  return values;
 }
@@ -1,11 +1,33 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <thread>
 
+#include <termios.h>
+
 #include "include/device_manager.hpp"
+#include "include/latency_tracer.hpp"
+
+/// Start the I/O threads
+DeviceManager::DeviceManager () : work (asio::make_work_guard (ctx))
+{
+  for (int t = 0; t < NUM_THREADS_IO; ++t)
+    {
+      this->io_threads.emplace_back ([this] () { this->ctx.run (); });
+    }
+}
 
 /// Clean the device manager
 DeviceManager::~DeviceManager ()
 {
+  this->work.reset ();
+  this->ctx.stop ();
+  for (auto &thread : this->io_threads)
+    {
+      thread.join ();
+    }
+
   this->devices.clear ();
   this->ports.clear ();
 }
@@ -34,25 +56,50 @@ DeviceManager::power_off ()
 void
 DeviceManager::register_ports ()
 {
+  std::unique_lock<std::shared_mutex> guard (this->registry_lock);
+
+  this->open_ports ();
+}
 
+/// Nothing else uses the chains while the ports are locked exclusively, so
+/// they are switched back without taking them
+void
+DeviceManager::open_ports ()
+{
   std::regex valid_port (".*USB.?");
 
+  // Devices keep their baud rate until they are reset, so chains are
+  // switched back before reopening the ports at the default rate
+  for (const auto &[port_name, chain] : this->ports)
+    {
+      serial_port::baud_rate baud_rate;
+      chain->port.get_option (baud_rate);
+      if (baud_rate.value () != DEFAULT_BAUD_RATE)
+        {
+          this->drop_input (chain.get ());
+          this->switch_baud_rate (port_name, DEFAULT_BAUD_RATE);
+        }
+    }
+
   this->devices.clear ();
+  this->ports.clear ();
 
-  for (auto &p : fs::directory_iterator ("/dev/"))
+  const char *dev_dir = std::getenv ("STATION_DEV_DIR");
+
+  for (auto &p : fs::directory_iterator (dev_dir ? dev_dir : DEV_DIR))
     {
       std::string port_path = p.path ();
       if (std::regex_match (port_path, valid_port))
         {
           auto port_name = p.path ().filename ();
-          auto port = new asio::serial_port (this->ctx);
+          auto chain = std::make_unique<port_ctx_t> (this->ctx);
 
           // Default port configuration
-          port->open (port_path);
-          port->set_option (serial_port::baud_rate (115200));
-          port->set_option (serial_port_base::character_size (8));
+          chain->port.open (port_path);
+          chain->port.set_option (serial_port::baud_rate (DEFAULT_BAUD_RATE));
+          chain->port.set_option (serial_port_base::character_size (8));
 
-          this->ports[port_name] = port;
+          this->ports[port_name] = std::move (chain);
           this->devices[port_name] = std::vector<dev_status_t> ();
         }
     }
@@ -61,6 +108,7 @@ DeviceManager::register_ports ()
 std::vector<std::string>
 DeviceManager::available_ports ()
 {
+  std::shared_lock<std::shared_mutex> guard (this->registry_lock);
   std::vector<std::string> ports;
 
   transform (begin (this->devices), end (this->devices), back_inserter (ports),
@@ -72,104 +120,721 @@ DeviceManager::available_ports ()
 DeviceMap
 DeviceManager::device_map ()
 {
+  std::shared_lock<std::shared_mutex> guard (this->registry_lock);
   return this->devices;
 }
 
-/// Send a header to all ports in a blocking way
-/// TODO: Add error handling
+/// Chains without devices are left out of the map of devices
+size_t
+DeviceManager::chain_size (const std::string &port_name)
+{
+  auto chain = this->devices.find (port_name);
+  return chain == this->devices.end () ? 0 : chain->second.size ();
+}
+
+std::future<size_t>
+DeviceManager::async_write_frame (const std::string &port_name,
+                                  const uint8_t *buf, const size_t &len)
+{
+  auto chain = this->ports.at (port_name).get ();
+  auto done = std::make_shared<std::promise<size_t> > ();
+  auto written = done->get_future ();
+
+  asio::post (chain->strand, [chain, buf, len, done] () {
+    asio::async_write (
+        chain->port, asio::buffer (buf, len),
+        [done] (const system::error_code &ec, size_t num_bytes) {
+          if (ec)
+            done->set_exception (
+                std::make_exception_ptr (system::system_error (ec)));
+          else
+            done->set_value (num_bytes);
+        });
+  });
+
+  return written;
+}
+
+/// Read a whole frame or give up once the deadline expires
+///
+/// The timer and the read share the strand of the port, so the flag telling
+/// which one finished first needs no further synchronization.
+///
+/// Bytes are read into the buffer of the chain as the driver hands them
+/// over, and the frame is taken out of it once complete. Bytes before the
+/// preamble of a frame are dropped, and so are frames whose CRC does not
+/// match, so a chain that lost a byte is back in step with the next frame.
+/// Bytes of the frames that follow are kept for the next read.
 void
-DeviceManager::broadcast_blocking (const uint8_t *buf, const int &len)
+DeviceManager::start_read_frame (port_ctx_t *chain, uint8_t *buf,
+                                 const size_t &len,
+                                 const std::chrono::milliseconds &timeout,
+                                 std::function<void (frame_status)> handler)
 {
-  for (auto [port_name, port] : this->ports)
+  struct read_op_t
+  {
+    port_ctx_t *chain;
+    uint8_t *buf;
+    size_t len;
+    asio::steady_timer timer;
+    bool expired = false;
+    bool finished = false;
+    bool corrupted = false;
+    std::function<void (frame_status)> handler;
+
+    read_op_t (port_ctx_t *c, uint8_t *b, const size_t &l,
+               std::function<void (frame_status)> h)
+        : chain (c), buf (b), len (l), timer (c->strand),
+          handler (std::move (h)){};
+
+    void
+    finish (const frame_status &status)
     {
-      port->write_some (asio::buffer (buf, len));
+      this->finished = true;
+      this->timer.cancel ();
+      this->handler (status);
     }
-}
 
-/// Listen for headers in every port in a blocking way
-///
-/// The number of devices in each port has to be supplied and has to be the
-/// same In future implementations this communication will be async and the
-/// number of devices will be dynamic
-/// @param num_devices number of headers to read
-std::vector<std::pair<std::string, header_t> >
-DeviceManager::listen_headers_block (const int num_devices)
-{
-  // Port name from where header came is needed later to send bodies
-  std::vector<std::pair<std::string, header_t> > headers;
-  auto msg_data = new char[sizeof (header_t)];
-
-  for (auto [port_name, port] : this->ports)
+    static void
+    next_frame (const std::shared_ptr<read_op_t> &op)
     {
+      auto &rx = op->chain->rx_bytes;
+      size_t start = frame_start (rx.data (), rx.size (), op->len, 0);
 
-      for (int dev = 0; dev < num_devices; ++dev)
+      // The size of the frame is known once the preamble and the size
+      // itself arrived
+      while (start < rx.size ()
+             && rx.size () - start >= offsetof (header_t, type))
         {
-          header_t header;
-          port->read_some (asio::buffer (msg_data, sizeof (header_t)));
-          memcpy (&header, msg_data, sizeof (header_t));
-          headers.push_back (std::make_pair (port_name, header));
+          auto size = frame_length (rx.data () + start);
+          if (rx.size () - start < size)
+            break;
+
+          if (frame_intact (rx.data () + start, size))
+            {
+              std::memcpy (op->buf, rx.data () + start, size);
+              rx.erase (rx.begin (), rx.begin () + start + size);
+              return op->finish (frame_status::OK);
+            }
+
+          // A frame that lost a byte ends inside the next one, which starts
+          // after the preamble of the corrupted one
+          op->corrupted = true;
+          start = frame_start (rx.data (), rx.size (), op->len, start + 1);
         }
+      rx.erase (rx.begin (), rx.begin () + start);
+
+      if (op->expired && op->corrupted)
+        return op->finish (frame_status::BAD_CRC);
+      if (op->expired)
+        return op->finish (rx.empty () ? frame_status::TIMEOUT
+                                       : frame_status::SHORT_FRAME);
+
+      // Whatever the driver has is read, up to a whole body
+      auto num_kept = rx.size ();
+      rx.resize (num_kept + sizeof (body_t));
+      op->chain->port.async_read_some (
+          asio::buffer (rx.data () + num_kept, sizeof (body_t)),
+          [op, num_kept] (const system::error_code &ec, size_t num_bytes) {
+            op->chain->rx_bytes.resize (num_kept + num_bytes);
+
+            if (ec && !op->expired)
+              return op->finish (frame_status::IO_ERROR);
+            next_frame (op);
+          });
     }
-  delete msg_data;
+  };
+
+  auto op = std::make_shared<read_op_t> (chain, buf, len, std::move (handler));
+
+  asio::dispatch (chain->strand, [chain, timeout, op] () {
+    op->timer.expires_after (timeout);
+    op->timer.async_wait ([chain, op] (const system::error_code &ec) {
+      if (ec || op->finished)
+        return;
+      op->expired = true;
+      chain->port.cancel ();
+    });
+
+    read_op_t::next_frame (op);
+  });
+}
+
+std::future<frame_status>
+DeviceManager::async_read_frame (const std::string &port_name, uint8_t *buf,
+                                 const size_t &len,
+                                 const std::chrono::milliseconds &timeout)
+{
+  auto chain = this->ports.at (port_name).get ();
+  auto done = std::make_shared<std::promise<frame_status> > ();
+  auto status = done->get_future ();
+
+  this->start_read_frame (chain, buf, len, timeout,
+                          [done] (frame_status st) { done->set_value (st); });
+
+  return status;
+}
+
+/// The bytes left are dropped once the previous transaction has released
+/// the chain
+chain_guard_t
+DeviceManager::lock_chain (const std::string &port_name)
+{
+  std::shared_lock<std::shared_mutex> registry (this->registry_lock);
+
+  auto chain = this->ports.at (port_name).get ();
+  std::unique_lock<std::mutex> transaction (chain->transaction_lock);
+  this->drop_input (chain);
 
-  return headers;
+  return { std::move (registry), std::move (transaction) };
 }
 
-/// Listen for headers in every port in a blocking way
+/// The bytes are dropped on the strand, where the reads of the chain use
+/// them
+void
+DeviceManager::drop_input (port_ctx_t *chain)
+{
+  std::promise<void> done;
+  asio::post (chain->strand, [chain, &done] () {
+    chain->rx_bytes.clear ();
+    tcflush (chain->port.native_handle (), TCIFLUSH);
+    done.set_value ();
+  });
+  done.get_future ().wait ();
+}
+
+port_frame_t<header_t>
+DeviceManager::listen_header_block (const std::string &port_name)
+{
+  TraceSpan span (trace_stage::WAIT_HEADER);
+
+  port_frame_t<header_t> header = { .port_name = port_name };
+  header.status = this->async_read_frame (
+                          port_name, (uint8_t *)&header.frame,
+                          sizeof (header_t),
+                          std::chrono::milliseconds (HEADER_TIMEOUT_MS))
+                      .get ();
+
+  return header;
+}
+
+/// Listen for a body in one port in a blocking way
 ///
-/// The number of devices in each port has to be supplied and has to be the
-/// same In future implementations this communication will be async and the
-/// number of devices will be dynamic
-body_t
+/// The frame is read by the I/O threads, the caller only waits for it to be
+/// complete.
+port_frame_t<body_t>
 DeviceManager::listen_body_block (const std::string &port_name)
 {
-  body_t body;
-  auto msg_data = new char[sizeof (body_t)];
-  auto port = this->ports[port_name];
-  port->read_some (asio::buffer (msg_data, sizeof (body_t)));
+  TraceSpan span (trace_stage::WAIT_BODY);
 
-  memcpy (&body, msg_data, sizeof (body_t));
+  port_frame_t<body_t> body = { .port_name = port_name };
+  body.status
+      = this->async_read_frame (port_name, (uint8_t *)&body.frame,
+                                sizeof (body_t),
+                                std::chrono::milliseconds (BODY_TIMEOUT_MS))
+            .get ();
 
-  delete msg_data;
   return body;
 }
 
+std::optional<std::string>
+DeviceManager::find_port (const std::string &board_id)
+{
+  std::shared_lock<std::shared_mutex> guard (this->registry_lock);
+
+  for (const auto &[port_name, devices] : this->devices)
+    {
+      for (const auto &dev : devices)
+        {
+          if (dev.board_id == board_id)
+            return port_name;
+        }
+    }
+  return std::nullopt;
+}
+
+void
+DeviceManager::send_header (const std::string &port_name, header_t &header)
+{
+  TraceSpan span (trace_stage::SEND_HEADER);
+
+  header.sync = FRAME_SYNC;
+  header.length = sizeof (header_t);
+  header.CRC = header_crc (header);
+  this->async_write_frame (port_name, (const uint8_t *)&header,
+                           sizeof (header_t))
+      .get ();
+}
+
+void
+DeviceManager::send_body (const std::string &port_name, body_t &body)
+{
+  TraceSpan span (trace_stage::SEND_BODY);
+
+  body.sync = FRAME_SYNC;
+  body.length = sizeof (body_t);
+  body.CRC = body_crc (body);
+  this->async_write_frame (port_name, (const uint8_t *)&body, sizeof (body_t))
+      .get ();
+}
+
+/// Full READ transaction for one block of memory
+///
+/// Only the chain of the device takes part in the transaction. No
+/// intermediate buffers are needed, the packets are sent straight from the
+/// structures owned by the caller.
+port_frame_t<body_t>
+DeviceManager::read_block (const std::string &port_name, header_t &header,
+                           body_t &body)
+{
+  auto guard = this->lock_chain (port_name);
+
+  this->send_header (port_name, header);
+
+  auto ack = this->listen_header_block (port_name);
+  if (ack.status != frame_status::OK)
+    return { .port_name = port_name, .status = ack.status };
+
+  this->send_body (port_name, body);
+  return this->listen_body_block (port_name);
+}
+
+/// Full WRITE transaction for one block of memory
+frame_status
+DeviceManager::write_block (const std::string &port_name, header_t &header,
+                            body_t &body)
+{
+  auto guard = this->lock_chain (port_name);
+
+  this->send_header (port_name, header);
+
+  auto ack = this->listen_header_block (port_name);
+  if (ack.status != frame_status::OK)
+    return ack.status;
+
+  this->send_body (port_name, body);
+  return frame_status::OK;
+}
+
+/// Stream a range of blocks with a single header
+///
+/// Blocks are read one after the other, the serial driver keeps the ones
+/// arriving in the meantime.
+frame_status
+DeviceManager::read_range (
+    const std::string &port_name, header_t &header,
+    const uint16_t &address_offset, const uint16_t &num_blocks,
+    const std::function<void (const body_t &)> &on_block)
+{
+  auto guard = this->lock_chain (port_name);
+
+  header.type = (uint8_t)header_type::RANGE_READ;
+  header.arg = address_offset | ((uint32_t)num_blocks << 16);
+  this->send_header (port_name, header);
+
+  for (uint32_t block = 0; block < num_blocks; ++block)
+    {
+      auto body = this->listen_body_block (port_name);
+      if (body.status != frame_status::OK)
+        return body.status;
+
+      if (body.frame.address_offset != address_offset + block)
+        return frame_status::UNEXPECTED;
+
+      on_block (body.frame);
+    }
+
+  auto trailer = this->listen_header_block (port_name);
+  if (trailer.status != frame_status::OK)
+    return trailer.status;
+
+  if (trailer.frame.type != (uint8_t)header_type::RANGE_END
+      || trailer.frame.arg != num_blocks)
+    return frame_status::UNEXPECTED;
+
+  return frame_status::OK;
+}
+
+/// Requests are matched with their answers by sequence number. Sequence
+/// number 0 is left to the requests sent one at a time, so that an answer
+/// to one of them that arrives late is never taken for one of these.
+void
+DeviceManager::read_ranges (
+    const std::string &port_name, std::vector<range_request_t> &requests,
+    const size_t &window,
+    const std::function<void (const range_request_t &, const body_t &)>
+        &on_block)
+{
+  auto guard = this->lock_chain (port_name);
+
+  auto &chain = *this->ports.at (port_name);
+  auto max_in_flight = std::clamp<size_t> (window, 1, UINT8_MAX);
+
+  std::map<uint8_t, size_t> in_flight;
+  std::vector<bool> sent (requests.size (), false);
+  std::vector<uint16_t> received (requests.size (), 0);
+  uint8_t frame[sizeof (body_t)];
+
+  auto device_busy = [&] (const header_t &header) {
+    for (const auto &[seq, i] : in_flight)
+      {
+        const auto &other = requests[i].header;
+        if (other.bid_high == header.bid_high
+            && other.bid_medium == header.bid_medium
+            && other.bid_low == header.bid_low)
+          return true;
+      }
+    return false;
+  };
+
+  while (true)
+    {
+      for (size_t i = 0;
+           i < requests.size () && in_flight.size () < max_in_flight; ++i)
+        {
+          auto &request = requests[i];
+          if (sent[i] || device_busy (request.header))
+            continue;
+
+          if (++chain.last_seq == 0)
+            chain.last_seq = 1;
+
+          request.header.type = (uint8_t)header_type::RANGE_READ;
+          request.header.seq = chain.last_seq;
+          request.header.arg = request.address_offset
+                               | ((uint32_t)request.num_blocks << 16);
+          this->send_header (port_name, request.header);
+
+          in_flight[request.header.seq] = i;
+          sent[i] = true;
+        }
+
+      if (in_flight.empty ())
+        break;
+
+      auto status = this->async_read_frame (
+                            port_name, frame, 0,
+                            std::chrono::milliseconds (BODY_TIMEOUT_MS))
+                        .get ();
+      if (status != frame_status::OK)
+        {
+          // The requests in flight are given up, the rest are still sent
+          for (const auto &[seq, i] : in_flight)
+            requests[i].status = status;
+          in_flight.clear ();
+          continue;
+        }
+
+      // Answers to requests already given up are dropped
+      bool is_body = frame_length (frame) == sizeof (body_t);
+      auto seq = is_body ? frame[offsetof (body_t, seq)]
+                         : frame[offsetof (header_t, seq)];
+      auto it = in_flight.find (seq);
+      if (it == in_flight.end ())
+        continue;
+
+      auto &request = requests[it->second];
+      auto &num_received = received[it->second];
+
+      if (is_body)
+        {
+          body_t body;
+          std::memcpy (&body, frame, sizeof (body_t));
+
+          if (num_received < request.num_blocks
+              && body.address_offset
+                     == request.address_offset + num_received)
+            {
+              num_received++;
+              on_block (request, body);
+              continue;
+            }
+          request.status = frame_status::UNEXPECTED;
+        }
+      else
+        {
+          header_t trailer;
+          std::memcpy (&trailer, frame, sizeof (header_t));
+
+          bool complete = trailer.type == (uint8_t)header_type::RANGE_END
+                          && trailer.arg == request.num_blocks
+                          && num_received == request.num_blocks;
+          request.status
+              = complete ? frame_status::OK : frame_status::UNEXPECTED;
+        }
+      in_flight.erase (it);
+    }
+}
+
+/// The digest comes back in the argument of the ACK. A range past the end
+/// of SRAM is refused with an empty RANGE_END instead
+frame_status
+DeviceManager::read_digest (const std::string &port_name, header_t &header,
+                            const uint16_t &address_offset,
+                            const uint16_t &num_blocks, uint32_t &digest)
+{
+  auto guard = this->lock_chain (port_name);
+
+  header.type = (uint8_t)header_type::DIGEST;
+  header.arg = address_offset | ((uint32_t)num_blocks << 16);
+  this->send_header (port_name, header);
+
+  auto ack = this->listen_header_block (port_name);
+  if (ack.status != frame_status::OK)
+    return ack.status;
+
+  if (ack.frame.type != (uint8_t)header_type::ACK)
+    return frame_status::UNEXPECTED;
+
+  digest = ack.frame.arg;
+  return frame_status::OK;
+}
+
+/// The devices count themselves with the TTL of the header, so the header
+/// carries how many devices are left to answer
+frame_status
+DeviceManager::read_collective (
+    const std::string &port_name, const uint16_t &address_offset,
+    const std::function<void (const body_t &)> &on_block)
+{
+  auto guard = this->lock_chain (port_name);
+
+  auto num_devices = this->chain_size (port_name);
+
+  header_t header = {
+    .type = (uint8_t)header_type::COLLECT,
+    .TTL = 0,
+    .CRC = 0,
+    .bid_high = 0,
+    .bid_medium = 0,
+    .bid_low = 0,
+    .arg = address_offset | ((uint32_t)num_devices << 16),
+  };
+  this->send_header (port_name, header);
+
+  // Every device answers, even the ones refusing the block, so the answers
+  // are all read before the chain is released
+  auto outcome = frame_status::OK;
+  uint8_t frame[sizeof (body_t)];
+  for (size_t dev = 0; dev < num_devices; ++dev)
+    {
+      TraceSpan span (trace_stage::WAIT_BODY);
+
+      auto status = this->async_read_frame (
+                            port_name, frame, 0,
+                            std::chrono::milliseconds (BODY_TIMEOUT_MS))
+                        .get ();
+      if (status != frame_status::OK)
+        return status;
+
+      // A block outside of memory is refused with a NACK
+      if (frame_length (frame) != sizeof (body_t))
+        {
+          outcome = frame_status::UNEXPECTED;
+          continue;
+        }
+
+      // A device that answers with another block, e.g. one whose firmware
+      // does not bound the block, would store it under the wrong address
+      body_t body;
+      std::memcpy (&body, frame, sizeof (body_t));
+      if (body.address_offset != address_offset)
+        {
+          outcome = frame_status::UNEXPECTED;
+          continue;
+        }
+
+      on_block (body);
+    }
+
+  return outcome;
+}
+
+/// Every device answers the PING with an ACK, the first device of the chain
+/// first
+std::vector<dev_status_t>
+DeviceManager::discover_chain (const std::string &port_name)
+{
+  header_t ping_header = {
+    .type = (uint8_t)header_type::PING,
+    .TTL = 0,
+    .CRC = 0,
+    .bid_high = 0,
+    .bid_medium = 0,
+    .bid_low = 0,
+  };
+  this->send_header (port_name, ping_header);
+
+  std::vector<dev_status_t> devices;
+  for (int dev = 0; dev < NUM_DEVS_PER_CHAIN; ++dev)
+    {
+      auto ack = this->listen_header_block (port_name);
+
+      // A chain stops answering after its last device
+      if (ack.status != frame_status::OK)
+        break;
+
+      dev_status_t status;
+      status.board_id = format_board_id (ack.frame.bid_high,
+                                         ack.frame.bid_medium,
+                                         ack.frame.bid_low);
+      status.TTL = ack.frame.TTL;
+      status.is_on = true;
+      devices.push_back (status);
+    }
+
+  return devices;
+}
+
 /// Send a ping to each port to discover devices
+///
+/// The chains are discovered at the same time, each in a thread of its own,
+/// so the call takes as long as the slowest chain. The ports stay locked
+/// exclusively until every thread is done, so no transaction runs in the
+/// meantime.
 void
 DeviceManager::register_devices ()
 {
+  std::unique_lock<std::shared_mutex> guard (this->registry_lock);
+
   // Register ports if there are no registered ports
   if (this->ports.empty ())
     {
-      this->register_ports ();
+      this->open_ports ();
     }
 
+  for (const auto &[port_name, chain] : this->ports)
+    this->drop_input (chain.get ());
+
+  std::map<std::string, std::future<std::vector<dev_status_t> > > chains;
+  for (const auto &[port_name, chain] : this->ports)
+    chains[port_name]
+        = std::async (std::launch::async, [this, name = port_name] {
+            return this->discover_chain (name);
+          });
+
   // Overwrite the values each time
   this->devices.clear ();
 
+  for (auto &[port_name, discovery] : chains)
+    {
+      auto devices = discovery.get ();
+      if (!devices.empty ())
+        this->devices[port_name] = std::move (devices);
+    }
+}
+
+size_t
+DeviceManager::count_acks (const std::string &port_name,
+                           const size_t &num_devices, const uint32_t &arg)
+{
+  size_t num_acks = 0;
+
+  // Every ACK is read, even after a wrong one, so none is left in the port
+  for (size_t dev = 0; dev < num_devices; ++dev)
+    {
+      auto ack = this->listen_header_block (port_name);
+      if (ack.status != frame_status::OK)
+        break;
+
+      if (ack.frame.type == (uint8_t)header_type::ACK && ack.frame.arg == arg)
+        num_acks++;
+    }
+
+  return num_acks;
+}
+
+/// Send the commit and switch the port once it is on the wire
+///
+/// The write completes once the bytes are handed to the driver, so the
+/// output is drained before switching.
+void
+DeviceManager::commit_baud_rate (const std::string &port_name,
+                                 const uint32_t &baud_rate)
+{
+  auto &port = this->ports.at (port_name)->port;
+
+  header_t commit_header = {
+    .type = (uint8_t)header_type::BAUD,
+    .TTL = 0,
+    .CRC = 0,
+    .bid_high = 0,
+    .bid_medium = 0,
+    .bid_low = 0,
+    .arg = baud_rate | BAUD_COMMIT,
+  };
+
+  this->send_header (port_name, commit_header);
+  tcdrain (port.native_handle ());
+  port.set_option (serial_port::baud_rate (baud_rate));
+}
+
+bool
+DeviceManager::set_baud_rate (const std::string &port_name,
+                              const uint32_t &baud_rate)
+{
+  auto guard = this->lock_chain (port_name);
+
+  return this->switch_baud_rate (port_name, baud_rate);
+}
+
+/// Propose the rate, commit it and confirm it with a PING
+bool
+DeviceManager::switch_baud_rate (const std::string &port_name,
+                                 const uint32_t &baud_rate)
+{
+  auto &port = this->ports.at (port_name)->port;
+  auto num_devices = this->chain_size (port_name);
+
+  serial_port::baud_rate prev_baud_rate;
+  port.get_option (prev_baud_rate);
+
+  if (baud_rate == prev_baud_rate.value ())
+    return true;
+
+  // Without devices there is nothing to confirm the rate with
+  if (num_devices == 0)
+    return false;
+
+  header_t baud_header = {
+    .type = (uint8_t)header_type::BAUD,
+    .TTL = 0,
+    .CRC = 0,
+    .bid_high = 0,
+    .bid_medium = 0,
+    .bid_low = 0,
+    .arg = baud_rate,
+  };
+
+  this->send_header (port_name, baud_header);
+  if (this->count_acks (port_name, num_devices, baud_rate) != num_devices)
+    return false;
+
+  this->commit_baud_rate (port_name, baud_rate);
+  std::this_thread::sleep_for (std::chrono::milliseconds (BAUD_SETTLE_MS));
+
   header_t ping_header = {
     .type = (uint8_t)header_type::PING,
     .TTL = 0,
-    .CRC = 0x45,
+    .CRC = 0,
     .bid_high = 0,
     .bid_medium = 0,
     .bid_low = 0,
   };
 
-  uint8_t *header_ser = new uint8_t[sizeof (header_t)];
-  memcpy (header_ser, &ping_header, sizeof (header_t));
-  this->broadcast_blocking (header_ser, sizeof (header_t));
-  delete header_ser;
+  this->send_header (port_name, ping_header);
+  if (this->count_acks (port_name, num_devices, 0) == num_devices)
+    return true;
 
-  auto acks = this->listen_headers_block (NUM_DEVS_PER_CHAIN);
+  // Devices that got the commit back wait for a confirmation as well, or
+  // they would go back to the new rate
+  this->commit_baud_rate (port_name, prev_baud_rate.value ());
+  std::this_thread::sleep_for (std::chrono::milliseconds (BAUD_SETTLE_MS));
 
-  for (const auto &[port_name, ack] : acks)
-    {
-      dev_status_t dev;
-      dev.board_id = fmt::format ("0x{0:08X}{1:08X}{2:08X}", ack.bid_high,
-                                  ack.bid_medium, ack.bid_low);
-      dev.TTL = ack.TTL;
-      dev.is_on = true;
-      this->devices[port_name].push_back (dev);
-    };
+  this->send_header (port_name, ping_header);
+  if (this->count_acks (port_name, num_devices, 0) != num_devices)
+    std::cerr << "Could not confirm the baud rate of " << port_name
+              << " after switching back\n";
+
+  return false;
 }
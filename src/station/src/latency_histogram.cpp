@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <bit>
+
+#include "include/latency_histogram.hpp"
+
+/// Values below this are counted exactly, one bucket per value
+#define HISTOGRAM_EXACT (2 * HISTOGRAM_SUB_BUCKETS)
+
+/// Bits of a value kept to choose its bucket
+#define HISTOGRAM_SUB_BITS 7
+
+/// Every power of two from HISTOGRAM_EXACT up to 2^64 takes
+/// HISTOGRAM_SUB_BUCKETS buckets
+#define HISTOGRAM_BUCKETS                                                     \
+  ((64 - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/// Bucket of a value
+///
+/// Values past HISTOGRAM_EXACT are shifted right until they keep
+/// HISTOGRAM_SUB_BITS bits, and the shift tells the power of two.
+static size_t
+bucket_index (const uint64_t &value)
+{
+  if (value < HISTOGRAM_EXACT)
+    return value;
+
+  int shift = std::bit_width (value) - HISTOGRAM_SUB_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift)
+         - HISTOGRAM_SUB_BUCKETS;
+}
+
+/// Highest value counted in a bucket
+static uint64_t
+bucket_highest (const size_t &index)
+{
+  if (index < HISTOGRAM_EXACT)
+    return index;
+
+  int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t lowest = (uint64_t)(index % HISTOGRAM_SUB_BUCKETS
+                               + HISTOGRAM_SUB_BUCKETS)
+                    << shift;
+  return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+LatencyHistogram::LatencyHistogram () : counts (HISTOGRAM_BUCKETS, 0) {}
+
+void
+LatencyHistogram::record (const uint64_t &value)
+{
+  this->counts[bucket_index (value)]++;
+  this->total++;
+  this->sum += value;
+  if (value < this->lowest)
+    this->lowest = value;
+  if (value > this->highest)
+    this->highest = value;
+}
+
+void
+LatencyHistogram::merge (const LatencyHistogram &other)
+{
+  for (size_t b = 0; b < this->counts.size (); ++b)
+    this->counts[b] += other.counts[b];
+
+  this->total += other.total;
+  this->sum += other.sum;
+  if (other.lowest < this->lowest)
+    this->lowest = other.lowest;
+  if (other.highest > this->highest)
+    this->highest = other.highest;
+}
+
+void
+LatencyHistogram::reset ()
+{
+  std::fill (this->counts.begin (), this->counts.end (), 0);
+  this->total = 0;
+  this->sum = 0;
+  this->lowest = UINT64_MAX;
+  this->highest = 0;
+}
+
+uint64_t
+LatencyHistogram::percentile (const double &percentile) const
+{
+  if (this->total == 0)
+    return 0;
+
+  // Rank of the value, the first one for the 0th percentile
+  uint64_t rank = percentile / 100.0 * this->total + 0.5;
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (size_t b = 0; b < this->counts.size (); ++b)
+    {
+      seen += this->counts[b];
+      if (seen >= rank)
+        return std::min (bucket_highest (b), this->highest);
+    }
+  return this->highest;
+}
+
+uint64_t
+LatencyHistogram::count () const
+{
+  return this->total;
+}
+
+uint64_t
+LatencyHistogram::min () const
+{
+  return this->total ? this->lowest : 0;
+}
+
+uint64_t
+LatencyHistogram::max () const
+{
+  return this->highest;
+}
+
+double
+LatencyHistogram::mean () const
+{
+  return this->total ? (double)this->sum / this->total : 0;
+}
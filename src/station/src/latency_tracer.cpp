@@ -0,0 +1,168 @@
+#include <algorithm>
+
+#include <fmt/core.h>
+
+#include "include/latency_tracer.hpp"
+
+const char *stage_name[TRACE_NUM_STAGES]
+    = { "read",
+        "write_invert",
+        "parse",
+        "send_header",
+        "wait_header",
+        "send_body",
+        "wait_body",
+        "claim_reference",
+        "get_reference",
+        "body_to_doc",
+        "enqueue",
+        "log",
+        "response",
+        "db_write",
+        "influx_write" };
+
+static_assert ((int)trace_stage::INFLUX_WRITE == TRACE_NUM_STAGES - 1,
+               "every stage needs a name");
+
+LatencyTracer::LatencyTracer () : epoch (std::chrono::steady_clock::now ())
+{
+}
+
+LatencyTracer &
+latency_tracer ()
+{
+  static LatencyTracer tracer;
+  return tracer;
+}
+
+struct LatencyTracer::thread_shard
+{
+  LatencyTracer *tracer = nullptr;
+  trace_shard_t *shard = nullptr;
+
+  ~thread_shard ()
+  {
+    if (this->shard != nullptr)
+      this->tracer->retire (this->shard);
+  }
+};
+
+/// Every thread records into its own shard, so spans recorded at the same
+/// time by several threads do not wait for each other. Threads come and
+/// go, e.g. the discovery of every chain, so the shard only lives as long
+/// as its thread.
+trace_shard_t &
+LatencyTracer::local_shard ()
+{
+  thread_local thread_shard local;
+
+  if (local.shard == nullptr)
+    {
+      std::lock_guard<std::mutex> guard (this->shards_lock);
+
+      auto new_shard = std::make_unique<trace_shard_t> ();
+      new_shard->recent.resize (TRACE_RECENT_SPANS);
+      new_shard->tid = this->next_tid++;
+      local.tracer = this;
+      local.shard = new_shard.get ();
+      this->shards.push_back (std::move (new_shard));
+    }
+  return *local.shard;
+}
+
+void
+LatencyTracer::retire (trace_shard_t *shard)
+{
+  std::lock_guard<std::mutex> guard (this->shards_lock);
+
+  auto it = std::find_if (this->shards.begin (), this->shards.end (),
+                          [shard] (const std::unique_ptr<trace_shard_t> &s) {
+                            return s.get () == shard;
+                          });
+  if (it == this->shards.end ())
+    return;
+
+  for (int s = 0; s < TRACE_NUM_STAGES; ++s)
+    this->retired[s].merge (shard->stages[s]);
+  this->shards.erase (it);
+}
+
+void
+LatencyTracer::record (const trace_stage &stage,
+                       const std::chrono::steady_clock::time_point &start,
+                       const std::chrono::steady_clock::time_point &end)
+{
+  auto &shard = this->local_shard ();
+  uint64_t start_ns = std::chrono::duration_cast<std::chrono::nanoseconds> (
+                          start - this->epoch)
+                          .count ();
+  uint64_t duration_ns
+      = std::chrono::duration_cast<std::chrono::nanoseconds> (end - start)
+            .count ();
+
+  std::lock_guard<std::mutex> guard (shard.lock);
+  shard.stages[(int)stage].record (duration_ns);
+  shard.recent[shard.next++ % TRACE_RECENT_SPANS]
+      = { .start_ns = start_ns, .duration_ns = duration_ns, .stage = stage };
+}
+
+std::array<LatencyHistogram, TRACE_NUM_STAGES>
+LatencyTracer::histograms ()
+{
+  std::lock_guard<std::mutex> guard (this->shards_lock);
+  std::array<LatencyHistogram, TRACE_NUM_STAGES> merged = this->retired;
+
+  for (auto &shard : this->shards)
+    {
+      std::lock_guard<std::mutex> shard_guard (shard->lock);
+      for (int s = 0; s < TRACE_NUM_STAGES; ++s)
+        merged[s].merge (shard->stages[s]);
+    }
+  return merged;
+}
+
+/// Spans are complete events, which Chrome nests by their times on each
+/// thread, so the stages show up under the request they belong to
+std::string
+LatencyTracer::chrome_trace ()
+{
+  std::string trace = "{\"traceEvents\":[";
+  bool first = true;
+
+  std::lock_guard<std::mutex> guard (this->shards_lock);
+  for (auto &shard : this->shards)
+    {
+      std::lock_guard<std::mutex> shard_guard (shard->lock);
+
+      uint64_t num_spans
+          = std::min<uint64_t> (shard->next, TRACE_RECENT_SPANS);
+      for (uint64_t i = shard->next - num_spans; i < shard->next; ++i)
+        {
+          const auto &span = shard->recent[i % TRACE_RECENT_SPANS];
+
+          trace += fmt::format (
+              "{}{{\"name\":\"{}\",\"ph\":\"X\",\"ts\":{:.3f},\"dur\":{:.3f},"
+              "\"pid\":1,\"tid\":{}}}",
+              first ? "" : ",", stage_name[(int)span.stage],
+              span.start_ns / 1000.0, span.duration_ns / 1000.0, shard->tid);
+          first = false;
+        }
+    }
+  trace += "]}";
+  return trace;
+}
+
+void
+LatencyTracer::reset ()
+{
+  std::lock_guard<std::mutex> guard (this->shards_lock);
+  for (auto &stage : this->retired)
+    stage.reset ();
+  for (auto &shard : this->shards)
+    {
+      std::lock_guard<std::mutex> shard_guard (shard->lock);
+      for (auto &stage : shard->stages)
+        stage.reset ();
+      shard->next = 0;
+    }
+}
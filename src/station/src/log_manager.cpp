@@ -1,6 +1,21 @@
 #include "include/log_manager.hpp"
+#include "include/latency_tracer.hpp"
 
 #include <chrono>
+#include <iostream>
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <fmt/core.h>
+
+namespace http = boost::beast::http;
+using boost::asio::ip::tcp;
+
+/// Gives access to the line protocol text built by influxdb_cpp
+struct line_builder : influxdb_cpp::builder
+{
+  using builder::lines_;
+};
 
 unsigned long int
 get_timestamp ()
@@ -11,64 +26,192 @@ get_timestamp ()
 }
 
 /// Default constructor
-Logger::Logger () : server ("127.0.0.1", 8086, "station") {}
+Logger::Logger () : Logger ("127.0.0.1", 8086, "station") {}
+
+Logger::Logger (const std::string &host, const int &port,
+                const std::string &db,
+                const std::chrono::milliseconds &flush_interval,
+                const size_t &max_batch)
+    : server (host, port, db), flush_interval (flush_interval),
+      max_batch (max_batch), socket (ctx)
+{
+  this->flusher = std::thread (&Logger::flush_batches, this);
+}
+
+Logger::~Logger ()
+{
+  {
+    std::lock_guard<std::mutex> guard (this->batch_lock);
+    this->stopping = true;
+  }
+  this->flusher_cv.notify_one ();
+  this->flusher.join ();
+}
+
+void
+Logger::push (const influxdb_cpp::builder &point)
+{
+  TraceSpan span (trace_stage::LOG);
+
+  auto line = (point.*(&line_builder::lines_)).str ();
+
+  std::lock_guard<std::mutex> guard (this->batch_lock);
+
+  // Losing points is better than growing without bound if InfluxDB is down
+  if (this->batch_size >= this->max_batch * LOG_MAX_BATCHES_QUEUED)
+    return;
+
+  this->batch += line;
+  this->batch += '\n';
+  this->batch_size++;
+
+  if (this->batch_size >= this->max_batch)
+    this->flusher_cv.notify_one ();
+}
+
+void
+Logger::flush_batches ()
+{
+  std::unique_lock<std::mutex> guard (this->batch_lock);
+  while (true)
+    {
+      this->flusher_cv.wait_for (guard, this->flush_interval, [this] {
+        return this->stopping || this->batch_size >= this->max_batch;
+      });
+
+      if (this->batch_size > 0)
+        {
+          std::string lines;
+          lines.swap (this->batch);
+          this->batch_size = 0;
+
+          guard.unlock ();
+
+          // Points queued while the last batch was written can exceed the
+          // size of a batch, and are written with several requests
+          size_t start = 0;
+          while (start < lines.size ())
+            {
+              size_t end = start;
+              for (size_t n = 0; n < this->max_batch && end < lines.size ();
+                   ++n)
+                end = lines.find ('\n', end) + 1;
+
+              this->write_batch (lines.substr (start, end - start));
+              start = end;
+            }
+
+          guard.lock ();
+        }
+
+      if (this->stopping && this->batch_size == 0)
+        break;
+    }
+}
+
+bool
+Logger::write_batch (const std::string &lines)
+{
+  TraceSpan span (trace_stage::INFLUX_WRITE);
+
+  http::request<http::string_body> req (
+      http::verb::post,
+      fmt::format ("/write?db={}&u={}&p={}&epoch={}", this->server.db_,
+                   this->server.usr_, this->server.pwd_,
+                   this->server.precision_),
+      11);
+  req.set (http::field::host, this->server.host_);
+  req.keep_alive (true);
+  req.body () = lines;
+  req.prepare_payload ();
+
+  // A kept-alive connection may have been closed by the server since the
+  // last batch, so a failed request is sent again on a new connection
+  for (int attempt = 0; attempt < 2; ++attempt)
+    {
+      try
+        {
+          if (!this->socket.is_open ())
+            {
+              this->socket.connect (tcp::endpoint (
+                  boost::asio::ip::make_address (this->server.host_),
+                  this->server.port_));
+            }
+
+          http::write (this->socket, req);
+
+          boost::beast::flat_buffer buffer;
+          http::response<http::string_body> res;
+          http::read (this->socket, buffer, res);
+
+          if (!res.keep_alive ())
+            this->socket.close ();
+
+          return res.result_int () / 100 == 2;
+        }
+      catch (std::exception &e)
+        {
+          boost::system::error_code ec;
+          this->socket.close (ec);
+
+          if (attempt > 0)
+            std::cerr << "Could not write to InfluxDB: " << e.what () << "\n";
+        }
+    }
+  return false;
+}
 
 void
 Logger::log_port_cmd (const std::string &port, const std::string &status)
 {
-        influxdb_cpp::builder ()
+        this->push (influxdb_cpp::builder ()
                 .meas ("devices")
                 .tag ("port", port)
                 .field ("status", "registered")
-                .timestamp (get_timestamp ())
-                .post_http (this->server);
+                .timestamp (get_timestamp ()));
 }
 
 void
 Logger::log_power_cycle (const std::string &status,
                          const std::string &port_name)
 {
-  influxdb_cpp::builder ()
+  this->push (influxdb_cpp::builder ()
       .meas ("devices")
       .tag ("status", "power")
       .field ("status", status)
       .field ("port", port_name)
-      .timestamp (get_timestamp ())
-      .post_http (this->server);
+      .timestamp (get_timestamp ()));
 }
 
 void
 Logger::log_command (const std::string &type, const std::string &value)
 {
-  influxdb_cpp::builder ()
+  this->push (influxdb_cpp::builder ()
       .meas ("commands")
       .tag ("type", type)
       .field ("action", value)
-      .timestamp (get_timestamp ())
-      .post_http (this->server);
+      .timestamp (get_timestamp ()));
 }
 
 void
 Logger::log_dev_cmd (const std::string &dev_id, const std::string &cmd_name,
                      const std::string &mem_address)
 {
-  influxdb_cpp::builder ()
+  this->push (influxdb_cpp::builder ()
       .meas ("commands")
       .tag ("command", cmd_name)
       .field ("device_id", dev_id)
       .field ("mem_address", mem_address)
-      .timestamp (get_timestamp ())
-      .post_http (this->server);
+      .timestamp (get_timestamp ()));
 }
 
 void
 Logger::log_sensor (const std::string &dev_id, const std::string &sensor,
                     const float &value)
 {
-  influxdb_cpp::builder ()
+  this->push (influxdb_cpp::builder ()
       .meas ("sensors")
       .tag ("device_id", dev_id)
       .field (sensor, value)
-      .timestamp (get_timestamp ())
-      .post_http (this->server);
+      .timestamp (get_timestamp ()));
 }
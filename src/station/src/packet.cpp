@@ -1,7 +1,181 @@
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
 #include "include/packet.hpp"
 
+/// Reflected polynomial of CRC-16/MODBUS
+#define CRC_POLY 0xA001
+
+/// Slicing-by-8 lookup tables, generated at compile time
+///
+/// crc_tables[0] is the classic byte-wise table. crc_tables[k] gives the
+/// contribution of a byte followed by k zero bytes, so 8 bytes can be folded
+/// into the CRC with 8 independent lookups.
+static constexpr auto crc_tables = [] () {
+  std::array<std::array<uint16_t, 256>, 8> tables{};
+
+  for (int i = 0; i < 256; ++i)
+    {
+      uint16_t crc = i;
+      for (int bit = 0; bit < 8; ++bit)
+        crc = (crc & 1) ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+      tables[0][i] = crc;
+    }
+
+  for (int i = 0; i < 256; ++i)
+    {
+      for (int k = 1; k < 8; ++k)
+        {
+          uint16_t prev = tables[k - 1][i];
+          tables[k][i] = (prev >> 8) ^ tables[0][prev & 0xFF];
+        }
+    }
+
+  return tables;
+}();
+
+uint16_t
+update_crc (uint16_t crc, const uint8_t *buf, const size_t &len)
+{
+  const auto &t = crc_tables;
+  size_t remaining = len;
+
+  while (remaining >= 8)
+    {
+      // Byte-wise loads keep the kernel independent of the host endianness,
+      // compilers merge them into single loads on little-endian targets
+      uint32_t lo
+          = (buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24)
+            ^ crc;
+      uint32_t hi
+          = buf[4] | buf[5] << 8 | buf[6] << 16 | (uint32_t)buf[7] << 24;
+
+      crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF]
+            ^ t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF]
+            ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+
+      buf += 8;
+      remaining -= 8;
+    }
+
+  while (remaining--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xFF];
+
+  return crc;
+}
+
 uint16_t
 compute_crc (const uint8_t *buf, const size_t &len)
 {
-  return 0x0;
+  return update_crc (CRC_INIT, buf, len);
+}
+
+/// Prime of FNV-1a, 32 bits
+#define DIGEST_PRIME 0x01000193
+
+uint32_t
+update_digest (uint32_t digest, const uint8_t *buf, const size_t &len)
+{
+  for (size_t i = 0; i < len; ++i)
+    digest = (digest ^ buf[i]) * DIGEST_PRIME;
+
+  return digest;
+}
+
+/// The CRC field splits the packet in two regions which are chained
+template <typename T>
+static uint16_t
+packet_crc (const T &packet)
+{
+  auto bytes = (const uint8_t *)&packet;
+  constexpr size_t before = offsetof (T, CRC);
+  constexpr size_t after = before + sizeof (packet.CRC);
+
+  uint16_t crc = update_crc (CRC_INIT, bytes, before);
+  return update_crc (crc, bytes + after, sizeof (T) - after);
+}
+
+uint16_t
+header_crc (const header_t &header)
+{
+  return packet_crc (header);
+}
+
+uint16_t
+body_crc (const body_t &body)
+{
+  return packet_crc (body);
+}
+
+size_t
+frame_start (const uint8_t *buf, const size_t &num_bytes, const size_t &len,
+              const size_t &from)
+{
+  for (size_t i = from; i < num_bytes; ++i)
+    {
+      if (buf[i] != (FRAME_SYNC & 0xFF))
+        continue;
+      if (i + 1 < num_bytes && buf[i + 1] != (FRAME_SYNC >> 8))
+        continue;
+      if (i + 3 < num_bytes)
+        {
+          auto size = frame_length (buf + i);
+          if (len ? size != len
+                  : size != sizeof (header_t) && size != sizeof (body_t))
+            continue;
+        }
+      return i;
+    }
+
+  return num_bytes;
+}
+
+size_t
+frame_length (const uint8_t *buf)
+{
+  return buf[2] | (buf[3] << 8);
+}
+
+/// Frames of any other size carry no CRC of their own
+bool
+frame_intact (const uint8_t *buf, const size_t &len)
+{
+  if (len == sizeof (header_t))
+    {
+      header_t header;
+      std::memcpy (&header, buf, len);
+      return header_crc (header) == header.CRC;
+    }
+
+  if (len == sizeof (body_t))
+    {
+      body_t body;
+      std::memcpy (&body, buf, len);
+      return body_crc (body) == body.CRC;
+    }
+
+  return true;
+}
+
+std::string
+format_board_id (const uint32_t &high, const uint32_t &medium,
+                 const uint32_t &low)
+{
+  return fmt::format ("0x{0:08X}{1:08X}{2:08X}", high, medium, low);
+}
+
+void
+parse_board_id (const std::string &board_id, uint32_t &high, uint32_t &medium,
+                uint32_t &low)
+{
+  if (board_id.size () != 26 || board_id.compare (0, 2, "0x") != 0)
+    {
+      throw std::invalid_argument ("invalid board_id " + board_id);
+    }
+
+  high = std::stoul (board_id.substr (2, 8), 0, 16);
+  medium = std::stoul (board_id.substr (10, 8), 0, 16);
+  low = std::stoul (board_id.substr (18, 8), 0, 16);
 }
@@ -0,0 +1,107 @@
+#include <sstream>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <fmt/core.h>
+
+#include "include/response.hpp"
+
+namespace bpt = boost::property_tree;
+
+/// Alphabet of base64, RFC 4648
+static const char base64_chars[]
+    = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+response_format
+negotiate_format (const std::string &accept, const std::string &format)
+{
+  if (format == "binary")
+    return response_format::BINARY;
+  if (format == "base64")
+    return response_format::COMPACT_JSON;
+  if (format == "json")
+    return response_format::PRETTY_JSON;
+
+  if (accept.find ("application/octet-stream") != std::string::npos)
+    return response_format::BINARY;
+
+  return response_format::PRETTY_JSON;
+}
+
+const char *
+content_type (const response_format &format)
+{
+  if (format == response_format::BINARY)
+    return "application/octet-stream";
+  return "application/json";
+}
+
+std::string
+encode_base64 (const uint8_t *data, const size_t &len)
+{
+  std::string encoded;
+  encoded.reserve ((len + 2) / 3 * 4);
+
+  size_t i = 0;
+  for (; i + 2 < len; i += 3)
+    {
+      uint32_t group = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+      encoded += base64_chars[(group >> 18) & 0x3F];
+      encoded += base64_chars[(group >> 12) & 0x3F];
+      encoded += base64_chars[(group >> 6) & 0x3F];
+      encoded += base64_chars[group & 0x3F];
+    }
+
+  if (i < len)
+    {
+      uint32_t group = data[i] << 16;
+      if (i + 1 < len)
+        group |= data[i + 1] << 8;
+
+      encoded += base64_chars[(group >> 18) & 0x3F];
+      encoded += base64_chars[(group >> 12) & 0x3F];
+      encoded += (i + 1 < len) ? base64_chars[(group >> 6) & 0x3F] : '=';
+      encoded += '=';
+    }
+
+  return encoded;
+}
+
+std::string
+read_response (const response_format &format, const std::string &board_id,
+               const std::string &mem_address, const body_t &body)
+{
+  switch (format)
+    {
+    case response_format::BINARY:
+      return std::string ((const char *)body.data, PAYLOAD_SIZE);
+
+    case response_format::COMPACT_JSON:
+      // Both ids are hex strings, so nothing has to be escaped
+      return fmt::format ("{{\"board_id\":\"{}\",\"mem_address\":\"{}\","
+                          "\"message\":\"region of memory read\","
+                          "\"encoding\":\"base64\",\"data\":\"{}\"}}",
+                          board_id, mem_address,
+                          encode_base64 (body.data, PAYLOAD_SIZE));
+
+    case response_format::PRETTY_JSON:
+    default:
+      {
+        bpt::ptree msg;
+        std::stringstream data, msg_ss;
+
+        msg.put ("board_id", board_id);
+        msg.put ("mem_address", mem_address);
+        msg.put ("message", "region of memory read");
+
+        for (int byte = 0; byte < PAYLOAD_SIZE - 1; ++byte)
+          {
+            data << (int)body.data[byte] << ",";
+          }
+        data << (int)body.data[PAYLOAD_SIZE - 1];
+        msg.put ("data", data.str ());
+
+        bpt::json_parser::write_json (msg_ss, msg, true);
+        return msg_ss.str ();
+      }
+    }
+}
@@ -5,6 +5,8 @@
 #include <served/served.hpp>
 
 #include "include/db_manager.hpp"
+#include "include/latency_tracer.hpp"
+#include "include/response.hpp"
 #include "include/station.hpp"
 
 using namespace std::chrono_literals;
@@ -57,6 +59,67 @@ Station::run (const std::string &host, const std::string &port)
         res << msg_ss.str ();
       });
 
+  mux.handle ("/ports/baud_rate")
+      .post ([this] (served::response &res, const served::request &req) {
+        bpt::ptree msg, input_pt;
+        std::stringstream msg_ss, input_ss;
+
+        uint32_t baud_rate;
+        std::string port_name;
+
+        try
+          {
+            input_ss << req.body ();
+            bpt::json_parser::read_json (input_ss, input_pt);
+
+            port_name = input_pt.get<std::string> ("port_name");
+            baud_rate = input_pt.get<uint32_t> ("baud_rate");
+          }
+        catch (std::exception &e)
+          {
+            msg.put ("message", e.what ());
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (400);
+            res << msg_ss.str ();
+            return;
+          }
+
+        auto ports = this->dev_manager.available_ports ();
+        if (std::find (ports.begin (), ports.end (), port_name)
+            == ports.end ())
+          {
+            msg.put ("message", "port is not registered");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (404);
+            res << msg_ss.str ();
+            return;
+          }
+
+        msg.put ("port_name", port_name);
+        msg.put ("baud_rate", baud_rate);
+
+        if (!this->dev_manager.set_baud_rate (port_name, baud_rate))
+          {
+            msg.put ("message", "devices did not switch to the baud rate");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (409);
+            res << msg_ss.str ();
+            return;
+          }
+
+        this->logger.log_port_cmd (port_name,
+                                   fmt::format ("BAUD_RATE {}", baud_rate));
+
+        msg.put ("message", "baud rate switched");
+        bpt::json_parser::write_json (msg_ss, msg, true);
+
+        res.set_status (200);
+        res << msg_ss.str ();
+      });
+
   mux.handle ("/devices/register")
       .get ([this] (served::response &res, const served::request &) {
         bpt::ptree msg;
@@ -135,20 +198,24 @@ Station::run (const std::string &host, const std::string &port)
 
   mux.handle ("/commands/read")
       .post ([this] (served::response &res, const served::request &req) {
+        TraceSpan request_span (trace_stage::READ);
         bpt::ptree msg, input_pt;
         std::stringstream msg_ss, input_ss;
 
-        uint16_t address_offset, mem_address;
+        uint16_t address_offset;
+        uint32_t mem_address, bid_high, bid_medium, bid_low;
         std::string address_str, board_id, port_name;
 
         try
           {
+            TraceSpan parse_span (trace_stage::PARSE);
             input_ss << req.body ();
             bpt::json_parser::read_json (input_ss, input_pt);
 
             board_id = input_pt.get<std::string> ("board_id");
             address_offset = input_pt.get<uint16_t> ("address_offset");
             port_name = input_pt.get<std::string> ("port_name");
+            parse_board_id (board_id, bid_high, bid_medium, bid_low);
           }
         catch (std::exception &e)
           {
@@ -160,70 +227,578 @@ Station::run (const std::string &host, const std::string &port)
             return;
           }
 
-        uint32_t bid_high = stoul (board_id.substr (2, 8), 0, 16);
-        uint32_t bid_medium = stoul (board_id.substr (10, 8), 0, 16);
-        uint32_t bid_low = stoul (board_id.substr (18, 8), 0, 16);
-        mem_address = address_offset * PAYLOAD_SIZE;
+        auto ports = this->dev_manager.available_ports ();
+        if (std::find (ports.begin (), ports.end (), port_name)
+            == ports.end ())
+          {
+            msg.put ("message", "port is not registered");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (404);
+            res << msg_ss.str ();
+            return;
+          }
+
+        mem_address = (uint32_t)address_offset * PAYLOAD_SIZE;
         address_str = fmt::format ("0x{:08x}", mem_address);
 
         header_t read_header = {
           .type = (uint8_t)header_type::READ,
           .TTL = 0,
-          .CRC = 0x69,
+          .CRC = 0,
           .bid_high = bid_high,
           .bid_medium = bid_medium,
           .bid_low = bid_low,
         };
-        auto ser_header = new uint8_t[sizeof (header_t)];
-        memcpy (ser_header, &read_header, sizeof (header_t));
-
-        this->dev_manager.broadcast_blocking (ser_header, sizeof (header_t));
-        this->dev_manager.listen_headers_block (1);
-
         body_t read_body = { .type = (uint8_t)body_type::MEMORY,
-                             .CRC = 0x69,
+                             .CRC = 0,
                              .bid_high = bid_high,
                              .bid_medium = bid_medium,
                              .bid_low = bid_low,
                              .address_offset = address_offset,
                              .data = { 0 } };
 
-        auto ser_body = new uint8_t[sizeof (body_t)];
-        memcpy (ser_body, &read_body, sizeof (body_t));
+        auto [ack_port, status, ack_body]
+            = this->dev_manager.read_block (port_name, read_header, read_body);
+
+        if (status != frame_status::OK)
+          {
+            msg.put ("board_id", board_id);
+            msg.put ("mem_address", address_str);
+            msg.put ("message",
+                     fmt::format ("device did not answer: {}", status));
+            bpt::json_parser::write_json (msg_ss, msg, true);
 
-        this->dev_manager.broadcast_blocking (ser_body, sizeof (body_t));
-        auto ack_body = this->dev_manager.listen_body_block (port_name);
+            res.set_status (504);
+            res << msg_ss.str ();
+            return;
+          }
 
         this->logger.log_dev_cmd(board_id, "READ", address_str);
 
-        delete ser_header;
-        delete ser_body;
-
-        bool exists
-            = this->db_manager.reference_present (board_id, address_str);
+        bool is_reference
+            = this->db_manager.claim_reference (board_id, address_str);
         bson_doc body_doc = this->db_manager.body_to_doc (ack_body);
 
-        if (exists)
+        if (is_reference)
           {
-            this->db_manager.insert_one (body_doc, "samples");
+            this->db_manager.enqueue (body_doc.extract (), "references");
           }
         else
           {
-            this->db_manager.insert_one (body_doc, "references");
+            this->db_manager.enqueue (body_doc.extract (), "samples");
+          }
+
+        TraceSpan response_span (trace_stage::RESPONSE);
+        auto format = negotiate_format (req.header ("Accept"),
+                                        req.query.get ("format"));
+
+        res.set_header ("Content-Type", content_type (format));
+        if (format == response_format::BINARY)
+          {
+            res.set_header ("X-Board-Id", board_id);
+            res.set_header ("X-Mem-Address", address_str);
+          }
+
+        res.set_status (200);
+        res << read_response (format, board_id, address_str, ack_body);
+      });
+
+  mux.handle ("/commands/dump")
+      .post ([this] (served::response &res, const served::request &req) {
+        bpt::ptree msg, input_pt;
+        std::stringstream msg_ss, input_ss;
+
+        uint16_t address_offset, num_blocks;
+        uint32_t bid_high, bid_medium, bid_low;
+        std::string address_str, board_id;
+
+        try
+          {
+            input_ss << req.body ();
+            bpt::json_parser::read_json (input_ss, input_pt);
+
+            board_id = input_pt.get<std::string> ("board_id");
+            address_offset = input_pt.get<uint16_t> ("address_offset");
+            num_blocks = input_pt.get<uint16_t> ("num_blocks");
+            parse_board_id (board_id, bid_high, bid_medium, bid_low);
+          }
+        catch (std::exception &e)
+          {
+            msg.put ("message", e.what ());
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (400);
+            res << msg_ss.str ();
+            return;
+          }
+
+        // The chain of the device is looked up once for the whole range
+        auto port_name = this->dev_manager.find_port (board_id);
+        if (!port_name || num_blocks == 0
+            || (uint32_t)address_offset + num_blocks > SRAM_NUM_BLOCKS)
+          {
+            msg.put ("message", port_name ? "invalid address range"
+                                          : "device is not registered");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (port_name ? 400 : 404);
+            res << msg_ss.str ();
+            return;
+          }
+
+        address_str = fmt::format ("0x{:08x}",
+                                   (uint32_t)address_offset * PAYLOAD_SIZE);
+
+        header_t range_header = {
+          .type = (uint8_t)header_type::RANGE_READ,
+          .TTL = 0,
+          .CRC = 0,
+          .bid_high = bid_high,
+          .bid_medium = bid_medium,
+          .bid_low = bid_low,
+        };
+
+        uint32_t num_references = 0, num_samples = 0;
+
+        // The whole range comes in one transaction, blocks are stored as
+        // they arrive so the ones read before a failure are kept
+        auto status = this->dev_manager.read_range (
+            *port_name, range_header, address_offset, num_blocks,
+            [&] (const body_t &block) {
+              auto mem_address = fmt::format (
+                  "0x{:08x}", (uint32_t)block.address_offset * PAYLOAD_SIZE);
+              auto body_doc = this->db_manager.body_to_doc (block);
+
+              if (this->db_manager.claim_reference (board_id, mem_address))
+                {
+                  this->db_manager.enqueue (body_doc.extract (), "references");
+                  num_references++;
+                }
+              else
+                {
+                  this->db_manager.enqueue (body_doc.extract (), "samples");
+                  num_samples++;
+                }
+            });
+
+        this->logger.log_dev_cmd (board_id, "DUMP", address_str);
+
+        msg.put ("board_id", board_id);
+        msg.put ("port_name", *port_name);
+        msg.put ("mem_address", address_str);
+        msg.put ("num_blocks", num_blocks);
+        msg.put ("references", num_references);
+        msg.put ("samples", num_samples);
+
+        if (status != frame_status::OK)
+          {
+            msg.put ("message",
+                     fmt::format ("device did not answer: {}", status));
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (504);
+            res << msg_ss.str ();
+            return;
+          }
+
+        msg.put ("message", "region of memory dumped");
+
+        bpt::json_parser::write_json (msg_ss, msg, true);
+
+        res.set_status (200);
+        res << msg_ss.str ();
+      });
+
+  mux.handle ("/commands/collect")
+      .post ([this] (served::response &res, const served::request &req) {
+        bpt::ptree msg, input_pt;
+        std::stringstream msg_ss, input_ss;
+
+        uint16_t address_offset;
+        std::string address_str, port_name;
+
+        try
+          {
+            input_ss << req.body ();
+            bpt::json_parser::read_json (input_ss, input_pt);
+
+            port_name = input_pt.get<std::string> ("port_name");
+            address_offset = input_pt.get<uint16_t> ("address_offset");
+          }
+        catch (std::exception &e)
+          {
+            msg.put ("message", e.what ());
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (400);
+            res << msg_ss.str ();
+            return;
+          }
+
+        auto ports = this->dev_manager.available_ports ();
+        if (std::find (ports.begin (), ports.end (), port_name)
+            == ports.end ())
+          {
+            msg.put ("message", "port is not registered");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (404);
+            res << msg_ss.str ();
+            return;
+          }
+
+        if (address_offset >= SRAM_NUM_BLOCKS)
+          {
+            msg.put ("message", "invalid address");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (400);
+            res << msg_ss.str ();
+            return;
+          }
+
+        address_str = fmt::format ("0x{:08x}",
+                                   (uint32_t)address_offset * PAYLOAD_SIZE);
+
+        uint32_t num_references = 0, num_samples = 0;
+
+        // Every device answers in the same pass, blocks are stored as they
+        // arrive so the ones read before a failure are kept
+        auto status = this->dev_manager.read_collective (
+            port_name, address_offset, [&] (const body_t &block) {
+              auto board_id = format_board_id (
+                  block.bid_high, block.bid_medium, block.bid_low);
+              auto body_doc = this->db_manager.body_to_doc (block);
+
+              if (this->db_manager.claim_reference (board_id, address_str))
+                {
+                  this->db_manager.enqueue (body_doc.extract (), "references");
+                  num_references++;
+                }
+              else
+                {
+                  this->db_manager.enqueue (body_doc.extract (), "samples");
+                  num_samples++;
+                }
+            });
+
+        this->logger.log_port_cmd (port_name,
+                                   fmt::format ("COLLECT {}", address_str));
+
+        msg.put ("port_name", port_name);
+        msg.put ("mem_address", address_str);
+        msg.put ("references", num_references);
+        msg.put ("samples", num_samples);
+
+        if (status != frame_status::OK)
+          {
+            msg.put ("message",
+                     fmt::format ("chain did not answer: {}", status));
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (504);
+            res << msg_ss.str ();
+            return;
+          }
+
+        msg.put ("message", "block collected from every device");
+
+        bpt::json_parser::write_json (msg_ss, msg, true);
+
+        res.set_status (200);
+        res << msg_ss.str ();
+      });
+
+  mux.handle ("/commands/dump_chain")
+      .post ([this] (served::response &res, const served::request &req) {
+        bpt::ptree msg, input_pt, devices_pt;
+        std::stringstream msg_ss, input_ss;
+
+        uint16_t address_offset, num_blocks;
+        size_t window;
+        std::string address_str, port_name;
+
+        try
+          {
+            input_ss << req.body ();
+            bpt::json_parser::read_json (input_ss, input_pt);
+
+            port_name = input_pt.get<std::string> ("port_name");
+            address_offset = input_pt.get<uint16_t> ("address_offset");
+            num_blocks = input_pt.get<uint16_t> ("num_blocks");
+            window = input_pt.get<size_t> ("window", READ_WINDOW);
+          }
+        catch (std::exception &e)
+          {
+            msg.put ("message", e.what ());
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (400);
+            res << msg_ss.str ();
+            return;
+          }
+
+        auto device_map = this->dev_manager.device_map ();
+        auto chain = device_map.find (port_name);
+        if (chain == device_map.end () || num_blocks == 0
+            || (uint32_t)address_offset + num_blocks > SRAM_NUM_BLOCKS)
+          {
+            msg.put ("message", chain != device_map.end ()
+                                    ? "invalid address range"
+                                    : "port is not registered");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (chain != device_map.end () ? 400 : 404);
+            res << msg_ss.str ();
+            return;
+          }
+
+        address_str = fmt::format ("0x{:08x}",
+                                   (uint32_t)address_offset * PAYLOAD_SIZE);
+
+        std::vector<range_request_t> requests;
+        for (const auto &dev : chain->second)
+          {
+            uint32_t bid_high, bid_medium, bid_low;
+            parse_board_id (dev.board_id, bid_high, bid_medium, bid_low);
+
+            range_request_t request = {
+              .header = {
+                .type = (uint8_t)header_type::RANGE_READ,
+                .TTL = 0,
+                .CRC = 0,
+                .bid_high = bid_high,
+                .bid_medium = bid_medium,
+                .bid_low = bid_low,
+              },
+              .address_offset = address_offset,
+              .num_blocks = num_blocks,
+            };
+            requests.push_back (request);
+          }
+
+        uint32_t num_references = 0, num_samples = 0;
+
+        // The devices stream their ranges at the same time, blocks are
+        // stored as they arrive so the ones read before a failure are kept
+        this->dev_manager.read_ranges (
+            port_name, requests, window,
+            [&] (const range_request_t &, const body_t &block) {
+              auto board_id = format_board_id (
+                  block.bid_high, block.bid_medium, block.bid_low);
+              auto mem_address = fmt::format (
+                  "0x{:08x}", (uint32_t)block.address_offset * PAYLOAD_SIZE);
+              auto body_doc = this->db_manager.body_to_doc (block);
+
+              if (this->db_manager.claim_reference (board_id, mem_address))
+                {
+                  this->db_manager.enqueue (body_doc.extract (), "references");
+                  num_references++;
+                }
+              else
+                {
+                  this->db_manager.enqueue (body_doc.extract (), "samples");
+                  num_samples++;
+                }
+            });
+
+        this->logger.log_port_cmd (port_name,
+                                   fmt::format ("DUMP {}", address_str));
+
+        bool complete = true;
+        for (const auto &request : requests)
+          {
+            bpt::ptree device_pt;
+            device_pt.put ("board_id",
+                           format_board_id (request.header.bid_high,
+                                            request.header.bid_medium,
+                                            request.header.bid_low));
+            device_pt.put ("status", fmt::format ("{}", request.status));
+            devices_pt.push_back (bpt::ptree::value_type ("", device_pt));
+
+            complete &= (request.status == frame_status::OK);
+          }
+
+        msg.put ("port_name", port_name);
+        msg.put ("mem_address", address_str);
+        msg.put ("num_blocks", num_blocks);
+        msg.put ("references", num_references);
+        msg.put ("samples", num_samples);
+        msg.add_child ("devices", devices_pt);
+
+        if (!complete)
+          {
+            msg.put ("message", "some devices did not answer");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (504);
+            res << msg_ss.str ();
+            return;
+          }
+
+        msg.put ("message", "region of memory dumped from every device");
+
+        bpt::json_parser::write_json (msg_ss, msg, true);
+
+        res.set_status (200);
+        res << msg_ss.str ();
+      });
+
+  mux.handle ("/commands/verify")
+      .post ([this] (served::response &res, const served::request &req) {
+        bpt::ptree msg, input_pt;
+        std::stringstream msg_ss, input_ss;
+
+        uint16_t address_offset, num_blocks;
+        uint32_t bid_high, bid_medium, bid_low;
+        std::string address_str, board_id, pattern;
+
+        try
+          {
+            input_ss << req.body ();
+            bpt::json_parser::read_json (input_ss, input_pt);
+
+            board_id = input_pt.get<std::string> ("board_id");
+            address_offset = input_pt.get<uint16_t> ("address_offset");
+            num_blocks = input_pt.get<uint16_t> ("num_blocks");
+            pattern = input_pt.get<std::string> ("pattern", "reference");
+            parse_board_id (board_id, bid_high, bid_medium, bid_low);
+
+            if (pattern != "reference" && pattern != "inverted")
+              throw std::invalid_argument ("unknown pattern " + pattern);
+          }
+        catch (std::exception &e)
+          {
+            msg.put ("message", e.what ());
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (400);
+            res << msg_ss.str ();
+            return;
+          }
+
+        auto port_name = this->dev_manager.find_port (board_id);
+        if (!port_name || num_blocks == 0
+            || (uint32_t)address_offset + num_blocks > SRAM_NUM_BLOCKS)
+          {
+            msg.put ("message", port_name ? "invalid address range"
+                                          : "device is not registered");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (port_name ? 400 : 404);
+            res << msg_ss.str ();
+            return;
+          }
+
+        address_str = fmt::format ("0x{:08x}",
+                                   (uint32_t)address_offset * PAYLOAD_SIZE);
+
+        // The expected contents come from the references, or from what
+        // write_invert writes to the device
+        std::vector<std::vector<uint8_t> > expected;
+        uint32_t expected_digest = DIGEST_INIT;
+
+        std::vector<std::string> mem_addresses;
+        for (uint32_t block = 0; block < num_blocks; ++block)
+          mem_addresses.push_back (fmt::format (
+              "0x{:08x}", (address_offset + block) * PAYLOAD_SIZE));
+
+        auto references
+            = this->db_manager.get_data_vectors (board_id, mem_addresses);
+
+        for (const auto &mem_address : mem_addresses)
+          {
+            auto found = references.find (mem_address);
+
+            if (found == references.end ()
+                || found->second.size () != PAYLOAD_SIZE)
+              {
+                msg.put ("message",
+                         "There is no reference sample with this criteria.");
+                bpt::json_parser::write_json (msg_ss, msg, true);
+
+                res.set_status (400);
+                res << msg_ss.str ();
+                return;
+              }
+
+            auto bytes = std::move (found->second);
+            if (pattern == "inverted")
+              bytes = invert_bytes_arr (bytes);
+
+            expected_digest = update_digest (expected_digest, bytes.data (),
+                                             bytes.size ());
+            expected.push_back (std::move (bytes));
           }
 
-        std::stringstream data;
+        header_t digest_header = {
+          .type = (uint8_t)header_type::DIGEST,
+          .TTL = 0,
+          .CRC = 0,
+          .bid_high = bid_high,
+          .bid_medium = bid_medium,
+          .bid_low = bid_low,
+        };
+
+        uint32_t digest = 0;
+        auto status = this->dev_manager.read_digest (
+            *port_name, digest_header, address_offset, num_blocks, digest);
 
         msg.put ("board_id", board_id);
+        msg.put ("port_name", *port_name);
         msg.put ("mem_address", address_str);
-        msg.put ("message", "region of memory read");
+        msg.put ("num_blocks", num_blocks);
+        msg.put ("pattern", pattern);
 
-        for (int byte = 0; byte < 511; ++byte)
+        // Blocks are only transferred when the region changed, and stored
+        // as samples like in a dump
+        bpt::ptree changed_arr;
+        uint32_t num_samples = 0;
+
+        if (status == frame_status::OK && digest != expected_digest)
           {
-            data << (int)ack_body.data[byte] << ",";
+            header_t range_header = digest_header;
+
+            status = this->dev_manager.read_range (
+                *port_name, range_header, address_offset, num_blocks,
+                [&] (const body_t &block) {
+                  auto mem_address = fmt::format (
+                      "0x{:08x}",
+                      (uint32_t)block.address_offset * PAYLOAD_SIZE);
+                  auto &bytes
+                      = expected[block.address_offset - address_offset];
+
+                  if (!std::equal (bytes.begin (), bytes.end (), block.data))
+                    changed_arr.push_back (
+                        bpt::ptree::value_type ("", mem_address));
+
+                  auto body_doc = this->db_manager.body_to_doc (block);
+                  this->db_manager.enqueue (body_doc.extract (), "samples");
+                  num_samples++;
+                });
           }
-        data << (int)ack_body.data[511];
-        msg.put ("data", data.str ());
+
+        this->logger.log_dev_cmd (board_id, "VERIFY", address_str);
+
+        if (status != frame_status::OK)
+          {
+            msg.put ("message",
+                     fmt::format ("device did not answer: {}", status));
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (504);
+            res << msg_ss.str ();
+            return;
+          }
+
+        msg.put ("digest", fmt::format ("0x{:08x}", digest));
+        msg.put ("expected_digest", fmt::format ("0x{:08x}", expected_digest));
+        msg.put ("changed", digest != expected_digest);
+        msg.put ("samples", num_samples);
+        msg.add_child ("changed_blocks", changed_arr);
+        msg.put ("message", digest == expected_digest ? "region unchanged"
+                                                      : "region changed");
 
         bpt::json_parser::write_json (msg_ss, msg, true);
 
@@ -233,20 +808,24 @@ Station::run (const std::string &host, const std::string &port)
 
   mux.handle ("/commands/write_invert")
       .post ([this] (served::response &res, const served::request &req) {
+        TraceSpan request_span (trace_stage::WRITE_INVERT);
         bpt::ptree msg, input_pt;
         std::stringstream msg_ss, input_ss;
 
-        uint16_t address_offset, mem_address;
+        uint16_t address_offset;
+        uint32_t mem_address, bid_high, bid_medium, bid_low;
         std::string address_str, board_id, port_name;
 
         try
           {
+            TraceSpan parse_span (trace_stage::PARSE);
             input_ss << req.body ();
             bpt::json_parser::read_json (input_ss, input_pt);
 
             board_id = input_pt.get<std::string> ("board_id");
             address_offset = input_pt.get<uint16_t> ("address_offset");
             port_name = input_pt.get<std::string> ("port_name");
+            parse_board_id (board_id, bid_high, bid_medium, bid_low);
           }
         catch (std::exception &e)
           {
@@ -258,34 +837,42 @@ Station::run (const std::string &host, const std::string &port)
             return;
           }
 
-        uint32_t bid_high = stoul (board_id.substr (2, 8), 0, 16);
-        uint32_t bid_medium = stoul (board_id.substr (10, 8), 0, 16);
-        uint32_t bid_low = stoul (board_id.substr (18, 8), 0, 16);
-        mem_address = address_offset * PAYLOAD_SIZE;
+        auto ports = this->dev_manager.available_ports ();
+        if (std::find (ports.begin (), ports.end (), port_name)
+            == ports.end ())
+          {
+            msg.put ("message", "port is not registered");
+            bpt::json_parser::write_json (msg_ss, msg, true);
+
+            res.set_status (404);
+            res << msg_ss.str ();
+            return;
+          }
+
+        mem_address = (uint32_t)address_offset * PAYLOAD_SIZE;
         address_str = fmt::format ("0x{:08x}", mem_address);
 
         header_t write_header = {
           .type = (uint8_t)header_type::WRITE,
           .TTL = 0,
-          .CRC = 0x34,
+          .CRC = 0,
           .bid_high = bid_high,
           .bid_medium = bid_medium,
           .bid_low = bid_low,
         };
-        auto ser_header = new uint8_t[sizeof (header_t)];
-        memcpy (ser_header, &write_header, sizeof (header_t));
-
-        this->dev_manager.broadcast_blocking (ser_header, sizeof (header_t));
-        this->dev_manager.listen_headers_block (1);
 
+        // The body carries the block, the device writes it at
+        // address_offset * PAYLOAD_SIZE like the block of a READ
         body_t write_body = { .type = (uint8_t)body_type::MEMORY,
-                              .CRC = 0x50,
+                              .CRC = 0,
                               .bid_high = bid_high,
                               .bid_medium = bid_medium,
                               .bid_low = bid_low,
-                              .address_offset = mem_address,
+                              .address_offset = address_offset,
                               .data = { 0 } };
 
+        // The reference is needed before the device is addressed, otherwise
+        // it would be left waiting for a body that never comes
         std::vector<uint8_t> bytes
             = this->db_manager.get_data_vector (board_id, address_str);
 
@@ -307,18 +894,26 @@ Station::run (const std::string &host, const std::string &port)
             write_body.data[b] = inverted_bytes[b];
           }
 
-        auto ser_body = new uint8_t[sizeof (body_t)];
-        memcpy (ser_body, &write_body, sizeof (body_t));
+        auto status = this->dev_manager.write_block (port_name, write_header,
+                                                     write_body);
 
-        this->dev_manager.broadcast_blocking (ser_body, sizeof (body_t));
+        msg.put ("board_id", board_id);
+        msg.put ("mem_address", address_str);
 
-        this->logger.log_dev_cmd(board_id, "WRITE", address_str);
+        if (status != frame_status::OK)
+          {
+            msg.put ("message",
+                     fmt::format ("device did not answer: {}", status));
+            bpt::json_parser::write_json (msg_ss, msg, true);
 
-        delete ser_header;
-        delete ser_body;
+            res.set_status (504);
+            res << msg_ss.str ();
+            return;
+          }
 
-        msg.put ("board_id", board_id);
-        msg.put ("mem_address", address_str);
+        this->logger.log_dev_cmd(board_id, "WRITE", address_str);
+
+        TraceSpan response_span (trace_stage::RESPONSE);
         msg.put ("message", "region of memory written");
 
         bpt::json_parser::write_json (msg_ss, msg, true);
@@ -327,6 +922,49 @@ Station::run (const std::string &host, const std::string &port)
         res << msg_ss.str ();
       });
 
+  mux.handle ("/metrics/latency")
+      .get ([] (served::response &res, const served::request &) {
+        bpt::ptree msg, stages_pt;
+        std::stringstream msg_ss;
+
+        auto histograms = latency_tracer ().histograms ();
+
+        for (int s = 0; s < TRACE_NUM_STAGES; ++s)
+          {
+            const auto &h = histograms[s];
+            if (h.count () == 0)
+              continue;
+
+            // Durations are recorded in nanoseconds
+            bpt::ptree stage_pt;
+            stage_pt.put ("count", h.count ());
+            stage_pt.put ("mean_us", h.mean () / 1000);
+            stage_pt.put ("p50_us", h.percentile (50) / 1000.0);
+            stage_pt.put ("p90_us", h.percentile (90) / 1000.0);
+            stage_pt.put ("p99_us", h.percentile (99) / 1000.0);
+            stage_pt.put ("p999_us", h.percentile (99.9) / 1000.0);
+            stage_pt.put ("max_us", h.max () / 1000.0);
+            stages_pt.add_child (stage_name[s], stage_pt);
+          }
+        msg.add_child ("stages", stages_pt);
+
+        bpt::json_parser::write_json (msg_ss, msg, true);
+
+        res.set_status (200);
+        res << msg_ss.str ();
+      })
+      .del ([] (served::response &res, const served::request &) {
+        latency_tracer ().reset ();
+        res.set_status (204);
+      });
+
+  mux.handle ("/metrics/trace")
+      .get ([] (served::response &res, const served::request &) {
+        res.set_header ("Content-Type", "application/json");
+        res.set_status (200);
+        res << latency_tracer ().chrome_trace ();
+      });
+
   served::net::server server (host, port, this->mux);
   std::cout << "Server listening on " << host << ":" << port << "\n";
 
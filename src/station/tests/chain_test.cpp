@@ -0,0 +1,402 @@
+/**
+ * @file chain_test.cpp
+ *
+ * @brief Transactions of the device manager against an emulated chain.
+ *
+ * The emulator, whose path is the only argument, is started with a chain
+ * of boards behind a pseudo-terminal in a temporary directory, which the
+ * device manager finds through STATION_DEV_DIR.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "include/device_manager.hpp"
+
+/// Boards of the emulated chain
+#define TEST_NUM_DEVS 3
+
+/// Transactions run by every thread at the same time
+#define TEST_ROUNDS 8
+
+/// Blocks read from every device with read_ranges
+#define TEST_RANGE_BLOCKS 4
+
+/// Times the chain is registered again while it is in use
+#define TEST_REGISTRATIONS 4
+
+/// Rate the chain is switched to
+#define TEST_BAUD_RATE 1000000
+
+/// ACK to the PING confirming a new rate from the last device, after the
+/// ACKs to the registration and to the proposal of the rate
+#define TEST_LOST_ACK (3 * TEST_NUM_DEVS)
+
+static int failures = 0;
+
+static void
+check (const bool &ok, const std::string &what)
+{
+  fmt::print ("{:<56} {}\n", what, ok ? "ok" : "FAIL");
+  if (!ok)
+    failures++;
+}
+
+/// Start the emulator and wait for the link of its chain to show up
+static pid_t
+start_emulator (const std::string &emulator, const fs::path &dir,
+                const std::vector<std::string> &options)
+{
+  std::vector<std::string> args
+      = { emulator, "-c", "1", "-n", std::to_string (TEST_NUM_DEVS), "-d",
+          dir.string () };
+  args.insert (args.end (), options.begin (), options.end ());
+
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      std::vector<char *> argv;
+      for (auto &arg : args)
+        argv.push_back (arg.data ());
+      argv.push_back (nullptr);
+
+      execv (argv[0], argv.data ());
+      std::_Exit (127);
+    }
+
+  for (int i = 0; i < 100 && !fs::exists (dir / "ttyUSB0"); ++i)
+    std::this_thread::sleep_for (std::chrono::milliseconds (20));
+
+  return pid;
+}
+
+static void
+stop_emulator (const pid_t &pid)
+{
+  kill (pid, SIGINT);
+  waitpid (pid, nullptr, 0);
+}
+
+/// Header and body addressed to a device
+static void
+address_device (const dev_status_t &dev, header_t &header, body_t &body)
+{
+  uint32_t bid_high, bid_medium, bid_low;
+  parse_board_id (dev.board_id, bid_high, bid_medium, bid_low);
+
+  header = {};
+  header.bid_high = bid_high;
+  header.bid_medium = bid_medium;
+  header.bid_low = bid_low;
+
+  body = {};
+  body.type = (uint8_t)body_type::MEMORY;
+  body.bid_high = bid_high;
+  body.bid_medium = bid_medium;
+  body.bid_low = bid_low;
+}
+
+/// Writes read back and range reads on the same chain from two threads
+static void
+check_concurrent_transactions (DeviceManager &manager,
+                               const std::string &port_name,
+                               const std::vector<dev_status_t> &devices)
+{
+  int num_written = 0;
+  int num_ranges = 0;
+
+  std::thread writer ([&] {
+    header_t header;
+    body_t body;
+    address_device (devices.front (), header, body);
+    body.address_offset = 7;
+
+    for (int round = 0; round < TEST_ROUNDS; ++round)
+      {
+        for (int b = 0; b < PAYLOAD_SIZE; ++b)
+          body.data[b] = b ^ round;
+
+        header.type = (uint8_t)header_type::WRITE;
+        if (manager.write_block (port_name, header, body) != frame_status::OK)
+          continue;
+
+        body_t read_body = body;
+        std::fill (std::begin (read_body.data), std::end (read_body.data), 0);
+        header.type = (uint8_t)header_type::READ;
+        auto read = manager.read_block (port_name, header, read_body);
+
+        if (read.status == frame_status::OK
+            && std::equal (std::begin (body.data), std::end (body.data),
+                           std::begin (read.frame.data)))
+          num_written++;
+      }
+  });
+
+  std::thread reader ([&] {
+    header_t header;
+    body_t body;
+    address_device (devices.back (), header, body);
+
+    for (int round = 0; round < TEST_ROUNDS; ++round)
+      {
+        int num_blocks = 0;
+        auto status = manager.read_range (
+            port_name, header, 0, 4,
+            [&] (const body_t &) { num_blocks++; });
+
+        if (status == frame_status::OK && num_blocks == 4)
+          num_ranges++;
+      }
+  });
+
+  writer.join ();
+  reader.join ();
+
+  check (num_written == TEST_ROUNDS,
+         "blocks written and read back while ranges are read");
+  check (num_ranges == TEST_ROUNDS,
+         "ranges read while blocks are written and read back");
+}
+
+/// Byte of a block written to a device before its ranges are read
+static uint8_t
+test_pattern (const size_t &dev, const uint16_t &block, const int &b)
+{
+  return (dev << 6) ^ (block << 4) ^ b;
+}
+
+/// Ranges of every device read with one request in flight and with more
+/// requests in flight than devices in the chain
+static void
+check_pipelined_ranges (DeviceManager &manager, const std::string &port_name,
+                        const std::vector<dev_status_t> &devices)
+{
+  for (size_t dev = 0; dev < devices.size (); ++dev)
+    {
+      header_t header;
+      body_t body;
+      address_device (devices[dev], header, body);
+
+      for (uint16_t block = 0; block < TEST_RANGE_BLOCKS; ++block)
+        {
+          body.address_offset = block;
+          for (int b = 0; b < PAYLOAD_SIZE; ++b)
+            body.data[b] = test_pattern (dev, block, b);
+
+          header.type = (uint8_t)header_type::WRITE;
+          manager.write_block (port_name, header, body);
+        }
+    }
+
+  for (size_t window : { (size_t)1, (size_t)2 * TEST_NUM_DEVS })
+    {
+      // Every device gets two requests, half of the blocks each
+      std::vector<range_request_t> requests;
+      std::vector<size_t> owner;
+      for (size_t dev = 0; dev < devices.size (); ++dev)
+        {
+          for (uint16_t first = 0; first < TEST_RANGE_BLOCKS;
+               first += TEST_RANGE_BLOCKS / 2)
+            {
+              range_request_t request;
+              body_t body;
+              address_device (devices[dev], request.header, body);
+              request.address_offset = first;
+              request.num_blocks = TEST_RANGE_BLOCKS / 2;
+              requests.push_back (request);
+              owner.push_back (dev);
+            }
+        }
+
+      size_t num_blocks = 0;
+      bool in_place = true;
+      manager.read_ranges (
+          port_name, requests, window,
+          [&] (const range_request_t &request, const body_t &body) {
+            auto dev = owner[&request - requests.data ()];
+            num_blocks++;
+
+            in_place &= format_board_id (body.bid_high, body.bid_medium,
+                                         body.bid_low)
+                        == devices[dev].board_id;
+            for (int b = 0; b < PAYLOAD_SIZE; ++b)
+              in_place &= body.data[b]
+                          == test_pattern (dev, body.address_offset, b);
+          });
+
+      bool complete = num_blocks == devices.size () * TEST_RANGE_BLOCKS;
+      for (const auto &request : requests)
+        complete &= request.status == frame_status::OK;
+
+      check (complete && in_place,
+             fmt::format ("ranges read with a window of {}", window));
+    }
+}
+
+/// Read one block of a device
+static bool
+read_ok (DeviceManager &manager, const std::string &port_name,
+         const dev_status_t &dev)
+{
+  header_t header;
+  body_t body;
+  address_device (dev, header, body);
+  header.type = (uint8_t)header_type::READ;
+
+  return manager.read_block (port_name, header, body).status
+         == frame_status::OK;
+}
+
+/// Read the same block of every device, and one past the end of SRAM
+static void
+check_collect (DeviceManager &manager, const std::string &port_name,
+               const std::vector<dev_status_t> &devices)
+{
+  std::vector<std::string> board_ids;
+  auto status = manager.read_collective (
+      port_name, 2, [&] (const body_t &body) {
+        if (body.address_offset == 2)
+          board_ids.push_back (format_board_id (
+              body.bid_high, body.bid_medium, body.bid_low));
+      });
+
+  bool in_order = board_ids.size () == devices.size ();
+  for (size_t dev = 0; in_order && dev < devices.size (); ++dev)
+    in_order = board_ids[dev] == devices[dev].board_id;
+  check (status == frame_status::OK && in_order,
+         "block collected from every device in order");
+
+  int num_blocks = 0;
+  status = manager.read_collective (port_name, SRAM_NUM_BLOCKS,
+                                    [&] (const body_t &) { num_blocks++; });
+  check (status == frame_status::UNEXPECTED && num_blocks == 0,
+         "block past SRAM is refused by every device");
+  check (read_ok (manager, port_name, devices.back ()),
+         "chain answers after the refusal");
+}
+
+/// Ports and devices registered again while blocks are read from the chain
+static void
+check_registration_under_load (DeviceManager &manager,
+                               const std::string &port_name,
+                               const std::vector<dev_status_t> &devices)
+{
+  std::atomic<bool> done = false;
+  int num_read = 0;
+
+  std::thread reader ([&] {
+    while (!done)
+      {
+        if (read_ok (manager, port_name, devices.back ()))
+          num_read++;
+      }
+  });
+
+  for (int round = 0; round < TEST_REGISTRATIONS; ++round)
+    {
+      manager.register_ports ();
+      manager.register_devices ();
+    }
+  done = true;
+  reader.join ();
+
+  auto device_map = manager.device_map ();
+  check (num_read > 0 && device_map[port_name].size () == devices.size (),
+         "chain registered again while blocks are read");
+  check (read_ok (manager, port_name, devices.back ()),
+         "chain answers after being registered again");
+}
+
+/// Every device switched and answered the confirmation, but one of the
+/// ACKs is lost on its way
+static void
+check_lost_confirm (DeviceManager &manager, const std::string &port_name,
+                    const std::vector<dev_status_t> &devices)
+{
+  check (!manager.set_baud_rate (port_name, TEST_BAUD_RATE),
+         "new rate is given up without every confirmation");
+
+  // Devices waiting for a confirmation would have gone back by now
+  std::this_thread::sleep_for (
+      std::chrono::milliseconds (2 * BAUD_CONFIRM_MS));
+  check (read_ok (manager, port_name, devices.back ()),
+         "chain stays at the previous rate");
+
+  check (manager.set_baud_rate (port_name, TEST_BAUD_RATE),
+         "new rate is kept once every device confirms it");
+  std::this_thread::sleep_for (
+      std::chrono::milliseconds (2 * BAUD_CONFIRM_MS));
+  check (read_ok (manager, port_name, devices.back ()),
+         "chain stays at the new rate");
+}
+
+/// Register the chain of the emulator
+static bool
+register_chain (DeviceManager &manager)
+{
+  manager.register_ports ();
+  manager.register_devices ();
+
+  auto device_map = manager.device_map ();
+  bool registered = device_map.size () == 1
+                    && device_map.begin ()->second.size () == TEST_NUM_DEVS;
+  check (registered, "every emulated device is registered");
+  return registered;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      fmt::print (stderr, "usage: {} chain_emu\n", argv[0]);
+      return 1;
+    }
+
+  char dir_template[] = "/tmp/chain_test.XXXXXX";
+  fs::path dir = mkdtemp (dir_template);
+  setenv ("STATION_DEV_DIR", dir.c_str (), 1);
+
+  auto emulator = start_emulator (argv[1], dir, {});
+  {
+    DeviceManager manager;
+    if (register_chain (manager))
+      {
+        auto chain = *manager.device_map ().begin ();
+        check_concurrent_transactions (manager, chain.first, chain.second);
+        check_pipelined_ranges (manager, chain.first, chain.second);
+        check_collect (manager, chain.first, chain.second);
+        check_registration_under_load (manager, chain.first, chain.second);
+      }
+  }
+  stop_emulator (emulator);
+
+  emulator = start_emulator (argv[1], dir,
+                             { "-x", std::to_string (TEST_LOST_ACK) });
+  {
+    DeviceManager manager;
+    if (register_chain (manager))
+      {
+        auto chain = *manager.device_map ().begin ();
+        check_lost_confirm (manager, chain.first, chain.second);
+      }
+  }
+  stop_emulator (emulator);
+
+  fs::remove_all (dir);
+  return failures ? 1 : 0;
+}
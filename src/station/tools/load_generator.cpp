@@ -0,0 +1,471 @@
+/**
+ * @file load_generator.cpp
+ *
+ * @brief Drive the REST API of the station and report its throughput and
+ * latencies.
+ *
+ * Every connection sends its next request as soon as the last one is
+ * answered, so the number of connections is the number of requests in
+ * flight. The mix of /commands/read and /commands/write_invert, and the
+ * blocks they target, are chosen at random among the devices registered
+ * by the station.
+ *
+ * The generator can also stand in for InfluxDB, answering the writes of
+ * the logger of the station without storing them.
+ *
+ * @author Sergio Vinagrero (servinagrero)
+ */
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <fmt/core.h>
+
+#include "include/latency_histogram.hpp"
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = boost::beast::http;
+namespace bpt = boost::property_tree;
+using tcp = boost::asio::ip::tcp;
+using steady_clock = std::chrono::steady_clock;
+
+/// Requests sent by the generator
+enum class load_op : uint8_t
+{
+  READ,
+  WRITE_INVERT,
+};
+
+static const char *op_name[] = { "read", "write_invert" };
+static const char *op_target[]
+    = { "/commands/read", "/commands/write_invert" };
+
+/// Settings of a run, from the command line
+typedef struct
+{
+  std::string host = "127.0.0.1";
+  std::string port = "8123";
+  size_t connections = 8;
+  double duration_s = 10;
+  double read_ratio = 0.9;
+  uint16_t first_block = 16;
+  uint16_t num_blocks = 16;
+  unsigned short influx_port = 0;
+} load_options_t;
+
+/// Device registered by the station
+typedef struct
+{
+  std::string port_name;
+  std::string board_id;
+} target_t;
+
+/// Latencies in microseconds and errors of one kind of request
+typedef struct
+{
+  LatencyHistogram latencies;
+  uint64_t errors = 0;
+} op_stats_t;
+
+/// Send one request and wait for its answer
+static http::response<http::string_body>
+request_sync (const load_options_t &opts, const http::verb &verb,
+              const std::string &target, const std::string &body)
+{
+  asio::io_context ctx;
+  tcp::resolver resolver (ctx);
+  beast::tcp_stream stream (ctx);
+
+  stream.connect (resolver.resolve (opts.host, opts.port));
+
+  http::request<http::string_body> req (verb, target, 11);
+  req.set (http::field::host, opts.host);
+  req.body () = body;
+  req.prepare_payload ();
+  http::write (stream, req);
+
+  beast::flat_buffer buffer;
+  http::response<http::string_body> res;
+  http::read (stream, buffer, res);
+
+  beast::error_code ec;
+  stream.socket ().shutdown (tcp::socket::shutdown_both, ec);
+  return res;
+}
+
+/// Devices registered by the station, on every port
+static std::vector<target_t>
+fetch_targets (const load_options_t &opts)
+{
+  std::vector<target_t> targets;
+  bpt::ptree ports_pt;
+  std::stringstream ports_ss;
+
+  ports_ss << request_sync (opts, http::verb::get, "/devices/available", "")
+                  .body ();
+  bpt::json_parser::read_json (ports_ss, ports_pt);
+
+  for (const auto &[port_name, devices] : ports_pt.get_child ("ports"))
+    {
+      for (const auto &dev : devices)
+        targets.push_back (
+            { port_name, dev.second.get<std::string> ("board_id") });
+    }
+  return targets;
+}
+
+/// Body of a request for a block of a device
+static std::string
+request_body (const target_t &target, const uint16_t &address_offset)
+{
+  return fmt::format (
+      "{{\"board_id\": \"{}\", \"address_offset\": {}, \"port_name\": "
+      "\"{}\"}}",
+      target.board_id, address_offset, target.port_name);
+}
+
+/// Connection sending requests one after the other until the deadline
+class Connection : public std::enable_shared_from_this<Connection>
+{
+  const load_options_t &opts;
+  const std::vector<target_t> &targets;
+  std::vector<op_stats_t> &stats;
+  steady_clock::time_point deadline;
+
+  beast::tcp_stream stream;
+  beast::flat_buffer buffer;
+  http::request<http::string_body> req;
+  http::response<http::string_body> res;
+
+  std::mt19937 rng;
+  load_op op;
+  steady_clock::time_point sent_at;
+
+public:
+  Connection (asio::io_context &ctx, const load_options_t &opts,
+              const std::vector<target_t> &targets,
+              std::vector<op_stats_t> &stats,
+              const steady_clock::time_point &deadline,
+              const unsigned int &seed)
+      : opts (opts), targets (targets), stats (stats), deadline (deadline),
+        stream (ctx), rng (seed)
+  {
+  }
+
+  void
+  start (const tcp::resolver::results_type &endpoints)
+  {
+    this->stream.async_connect (
+        endpoints, [self = shared_from_this ()] (
+                       beast::error_code ec, const tcp::endpoint &) {
+          if (ec)
+            {
+              std::cerr << "Could not connect: " << ec.message () << "\n";
+              return;
+            }
+          // Requests are small and must not wait for the ACK of the last
+          self->stream.socket ().set_option (tcp::no_delay (true));
+          self->send_next ();
+        });
+  }
+
+private:
+  void
+  send_next ()
+  {
+    if (steady_clock::now () >= this->deadline)
+      {
+        beast::error_code ec;
+        this->stream.socket ().shutdown (tcp::socket::shutdown_both, ec);
+        return;
+      }
+
+    std::uniform_real_distribution<double> mix (0, 1);
+    std::uniform_int_distribution<size_t> pick (0, this->targets.size () - 1);
+    std::uniform_int_distribution<uint16_t> block (
+        this->opts.first_block,
+        this->opts.first_block + this->opts.num_blocks - 1);
+
+    this->op = (mix (this->rng) < this->opts.read_ratio)
+                   ? load_op::READ
+                   : load_op::WRITE_INVERT;
+
+    this->req = {};
+    this->req.method (http::verb::post);
+    this->req.target (op_target[(int)this->op]);
+    this->req.version (11);
+    this->req.set (http::field::host, this->opts.host);
+    this->req.keep_alive (true);
+    this->req.body ()
+        = request_body (this->targets[pick (this->rng)], block (this->rng));
+    this->req.prepare_payload ();
+
+    this->sent_at = steady_clock::now ();
+    http::async_write (
+        this->stream, this->req,
+        [self = shared_from_this ()] (beast::error_code ec, size_t) {
+          if (ec)
+            return self->fail (ec);
+          self->read_answer ();
+        });
+  }
+
+  void
+  read_answer ()
+  {
+    this->res = {};
+    http::async_read (
+        this->stream, this->buffer, this->res,
+        [self = shared_from_this ()] (beast::error_code ec, size_t) {
+          if (ec)
+            return self->fail (ec);
+
+          auto elapsed
+              = std::chrono::duration_cast<std::chrono::microseconds> (
+                  steady_clock::now () - self->sent_at);
+          auto &op_stats = self->stats[(int)self->op];
+
+          if (self->res.result_int () == 200)
+            op_stats.latencies.record (elapsed.count ());
+          else
+            op_stats.errors++;
+
+          self->send_next ();
+        });
+  }
+
+  void
+  fail (const beast::error_code &ec)
+  {
+    this->stats[(int)this->op].errors++;
+    std::cerr << "Connection lost: " << ec.message () << "\n";
+  }
+};
+
+/// Session of the InfluxDB stand-in, answering every write with 204
+class InfluxSession : public std::enable_shared_from_this<InfluxSession>
+{
+  beast::tcp_stream stream;
+  beast::flat_buffer buffer;
+  http::request<http::string_body> req;
+  http::response<http::empty_body> res;
+
+public:
+  explicit InfluxSession (tcp::socket &&socket) : stream (std::move (socket))
+  {
+  }
+
+  void
+  read_request ()
+  {
+    this->req = {};
+    http::async_read (
+        this->stream, this->buffer, this->req,
+        [self = shared_from_this ()] (beast::error_code ec, size_t) {
+          if (ec)
+            return;
+
+          self->res = {};
+          self->res.result (http::status::no_content);
+          self->res.version (self->req.version ());
+          self->res.keep_alive (self->req.keep_alive ());
+
+          http::async_write (
+              self->stream, self->res,
+              [self] (beast::error_code ec, size_t) {
+                if (!ec)
+                  self->read_request ();
+              });
+        });
+  }
+};
+
+/// Accept connections for the InfluxDB stand-in
+static void
+accept_influx (tcp::acceptor &acceptor)
+{
+  acceptor.async_accept ([&acceptor] (beast::error_code ec,
+                                      tcp::socket socket) {
+    if (!ec)
+      std::make_shared<InfluxSession> (std::move (socket))->read_request ();
+    accept_influx (acceptor);
+  });
+}
+
+/// Read every block once, so write_invert finds its references
+static void
+warm_up (const load_options_t &opts, const std::vector<target_t> &targets)
+{
+  for (const auto &target : targets)
+    {
+      for (uint16_t block = 0; block < opts.num_blocks; ++block)
+        {
+          auto res = request_sync (
+              opts, http::verb::post, op_target[(int)load_op::READ],
+              request_body (target, opts.first_block + block));
+          if (res.result_int () != 200)
+            std::cerr << fmt::format ("Could not read block {} of {}\n",
+                                      opts.first_block + block,
+                                      target.board_id);
+        }
+    }
+}
+
+static void
+print_stats (const std::string &name, const op_stats_t &op_stats,
+             const double &elapsed_s)
+{
+  const auto &lat = op_stats.latencies;
+
+  std::cout << fmt::format (
+      "{:<13} {:>8} {:>7} {:>9.1f} {:>9} {:>9} {:>9} {:>9} {:>9}\n", name,
+      lat.count (), op_stats.errors, lat.count () / elapsed_s,
+      lat.percentile (50), lat.percentile (90), lat.percentile (99),
+      lat.percentile (99.9), lat.max ());
+}
+
+static void
+usage (const char *name)
+{
+  std::cerr << fmt::format (
+      "usage: {} [-h host] [-p port] [-c connections] [-d seconds]\n"
+      "          [-r read ratio] [-a first block] [-n blocks]\n"
+      "          [-i influx port]\n",
+      name);
+}
+
+int
+main (int argc, char **argv)
+{
+  load_options_t opts;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "h:p:c:d:r:a:n:i:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'h':
+          opts.host = optarg;
+          break;
+        case 'p':
+          opts.port = optarg;
+          break;
+        case 'c':
+          opts.connections = std::stoul (optarg);
+          break;
+        case 'd':
+          opts.duration_s = std::stod (optarg);
+          break;
+        case 'r':
+          opts.read_ratio = std::stod (optarg);
+          break;
+        case 'a':
+          opts.first_block = std::stoul (optarg);
+          break;
+        case 'n':
+          opts.num_blocks = std::stoul (optarg);
+          break;
+        case 'i':
+          opts.influx_port = std::stoul (optarg);
+          break;
+        default:
+          usage (argv[0]);
+          return 1;
+        }
+    }
+  if (opts.connections < 1 || opts.num_blocks < 1)
+    {
+      usage (argv[0]);
+      return 1;
+    }
+
+  asio::io_context ctx;
+
+  // The stand-in keeps answering the logger while the station is warmed
+  // up, so it runs on its own thread
+  std::unique_ptr<tcp::acceptor> influx;
+  std::thread influx_thread;
+  asio::io_context influx_ctx;
+  if (opts.influx_port)
+    {
+      influx = std::make_unique<tcp::acceptor> (
+          influx_ctx, tcp::endpoint (asio::ip::make_address ("127.0.0.1"),
+                                     opts.influx_port));
+      accept_influx (*influx);
+      influx_thread = std::thread ([&influx_ctx] { influx_ctx.run (); });
+    }
+
+  std::vector<target_t> targets;
+  try
+    {
+      targets = fetch_targets (opts);
+    }
+  catch (std::exception &e)
+    {
+      std::cerr << "Could not get the devices: " << e.what () << "\n";
+      return 1;
+    }
+  if (targets.empty ())
+    {
+      std::cerr << "No devices registered, see /devices/register\n";
+      return 1;
+    }
+
+  if (opts.read_ratio < 1)
+    warm_up (opts, targets);
+
+  std::vector<op_stats_t> stats (2);
+  auto start = steady_clock::now ();
+  auto deadline = start
+                  + std::chrono::duration_cast<steady_clock::duration> (
+                      std::chrono::duration<double> (opts.duration_s));
+
+  tcp::resolver resolver (ctx);
+  auto endpoints = resolver.resolve (opts.host, opts.port);
+  for (size_t c = 0; c < opts.connections; ++c)
+    {
+      std::make_shared<Connection> (ctx, opts, targets, stats, deadline, c)
+          ->start (endpoints);
+    }
+  ctx.run ();
+
+  double elapsed_s
+      = std::chrono::duration<double> (steady_clock::now () - start).count ();
+
+  std::cout << fmt::format ("{} devices, {} connections, {:.1f} s\n",
+                            targets.size (), opts.connections, elapsed_s);
+  std::cout << fmt::format (
+      "{:<13} {:>8} {:>7} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9}\n", "request",
+      "ok", "errors", "req/s", "p50 us", "p90 us", "p99 us", "p99.9 us",
+      "max us");
+
+  op_stats_t all;
+  for (int op = 0; op < 2; ++op)
+    {
+      print_stats (op_name[op], stats[op], elapsed_s);
+      all.latencies.merge (stats[op].latencies);
+      all.errors += stats[op].errors;
+    }
+  print_stats ("all", all, elapsed_s);
+
+  if (influx)
+    {
+      influx_ctx.stop ();
+      influx_thread.join ();
+    }
+  return 0;
+}